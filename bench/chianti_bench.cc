@@ -0,0 +1,693 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+/**
+ * Micro-benchmarks of the loaders, the augmentors, the target encoding and
+ * the image collation on a synthetic dataset. The results are written as
+ * JSON, so they can be compared between revisions.
+ *
+ * Usage: chianti_bench [--output FILE] [--dir DIR] [--min-time SECONDS]
+ *                      [--quick]
+ */
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "chianti/augmentors.h"
+#include "chianti/iterators.h"
+#include "chianti/loaders.h"
+#include "chianti/providers.h"
+#include "collate.h"
+
+namespace {
+
+    using namespace chianti;
+
+    /**
+     * The result of a single benchmark.
+     */
+    struct Result {
+        /**
+         * The component group, e.g. "loader" or "augmentor".
+         */
+        std::string group;
+        /**
+         * The name of the benchmarked component.
+         */
+        std::string name;
+        /**
+         * The height of the images.
+         */
+        int height;
+        /**
+         * The width of the images.
+         */
+        int width;
+        /**
+         * The number of classes or 0 if it does not apply.
+         */
+        int numClasses;
+        /**
+         * The number of timed iterations.
+         */
+        uint64_t iterations;
+        /**
+         * The mean time per iteration in microseconds.
+         */
+        double meanMicros;
+        /**
+         * The fastest iteration in microseconds or a negative value if only
+         * the mean is known.
+         */
+        double minMicros;
+        /**
+         * The median iteration in microseconds or a negative value if only
+         * the mean is known.
+         */
+        double medianMicros;
+    };
+
+    /**
+     * The benchmark settings.
+     */
+    struct Settings {
+        /**
+         * The minimum time in seconds each benchmark is run for.
+         */
+        double minTime;
+        /**
+         * The image sizes (height, width) to benchmark.
+         */
+        std::vector<std::array<int, 2>> sizes;
+        /**
+         * The numbers of classes to benchmark.
+         */
+        std::vector<int> classCounts;
+        /**
+         * The directory the synthetic dataset is written to.
+         */
+        std::string directory;
+        /**
+         * The file the results are written to. Empty for stdout.
+         */
+        std::string output;
+    };
+
+    /**
+     * The minimum number of timed iterations of each benchmark.
+     */
+    const uint64_t kMinIterations = 5;
+
+    /**
+     * The number of samples of the synthetic dataset.
+     */
+    const int kNumSamples = 8;
+
+    /**
+     * Times body until it has run for at least minTime seconds. prepare is
+     * called before each iteration and is not timed.
+     *
+     * @param group The component group.
+     * @param name The name of the component.
+     * @param height The image height.
+     * @param width The image width.
+     * @param numClasses The number of classes.
+     * @param minTime The minimum time in seconds.
+     * @param prepare Sets up the next iteration.
+     * @param body The code to time.
+     * @return The result.
+     */
+    Result measure(
+            const std::string & group,
+            const std::string & name,
+            int height,
+            int width,
+            int numClasses,
+            double minTime,
+            const std::function<void()> & prepare,
+            const std::function<void()> & body) {
+        // Warm up caches and lazily allocated buffers
+        prepare();
+        body();
+
+        std::vector<double> samples;
+        double total = 0;
+        while (total < minTime || samples.size() < kMinIterations) {
+            prepare();
+            const auto start = std::chrono::steady_clock::now();
+            body();
+            const double elapsed = std::chrono::duration<double, std::micro>(
+                    std::chrono::steady_clock::now() - start).count();
+            samples.push_back(elapsed);
+            total += 1e-6 * elapsed;
+        }
+
+        std::sort(samples.begin(), samples.end());
+        Result result = {
+            group, name, height, width, numClasses, samples.size(),
+            1e6 * total / samples.size(),
+            samples.front(),
+            samples[samples.size() / 2]
+        };
+        return result;
+    }
+
+    /**
+     * Prints the progress to stderr.
+     *
+     * @param result The result of the last benchmark.
+     */
+    void report(const Result & result) {
+        std::cerr << result.group << "/" << result.name << " "
+                << result.height << "x" << result.width;
+        if (result.numClasses > 0) {
+            std::cerr << " classes=" << result.numClasses;
+        }
+        std::cerr << ": " << result.meanMicros << "us" << std::endl;
+    }
+
+    /**
+     * A synthetic segmentation dataset that is written to disk once, so the
+     * loaders read it from the page cache. For every sample, there is an RGB
+     * image, a label image and the label image encoded as colors.
+     */
+    class SyntheticDataset {
+    public:
+        /**
+         * Generates the dataset.
+         *
+         * @param _directory The directory to write the files to.
+         * @param height The image height.
+         * @param width The image width.
+         * @param numClasses The number of classes.
+         */
+        SyntheticDataset(
+                const std::string & _directory,
+                int height,
+                int width,
+                int numClasses) :
+        directory(_directory) {
+            // Every class gets a distinct color
+            for (int c = 0; c < numClasses; c++) {
+                const cv::Vec3b color(
+                        static_cast<uchar>(c),
+                        static_cast<uchar>(255 - c),
+                        static_cast<uchar>(37 * c));
+                colorMap[color] = static_cast<uchar>(c);
+                palette.push_back(color);
+            }
+            for (int i = 0; i < 256; i++) {
+                valueMap[i] = static_cast<uchar>(i % numClasses);
+            }
+
+            for (int i = 0; i < kNumSamples; i++) {
+                // Smooth images and blocky label maps compress like real
+                // photographs and annotations
+                cv::Mat coarse(std::max(1, height / 8), std::max(1, width / 8),
+                        CV_8UC3);
+                cv::randu(coarse, cv::Scalar::all(0), cv::Scalar::all(256));
+                cv::Mat image;
+                cv::resize(coarse, image, cv::Size(width, height), 0, 0,
+                        CV_INTER_LINEAR);
+
+                cv::Mat coarseLabels(std::max(1, height / 32),
+                        std::max(1, width / 32), CV_8UC1);
+                cv::randu(coarseLabels, cv::Scalar::all(0),
+                        cv::Scalar::all(numClasses));
+                cv::Mat labels;
+                cv::resize(coarseLabels, labels, cv::Size(width, height), 0, 0,
+                        CV_INTER_NN);
+
+                cv::Mat colors(height, width, CV_8UC3);
+                for (int y = 0; y < height; y++) {
+                    for (int x = 0; x < width; x++) {
+                        colors.at<cv::Vec3b>(y, x) =
+                                palette[labels.at<uchar>(y, x)];
+                    }
+                }
+
+                images.push_back(write(image, "image", i));
+                labelMaps.push_back(write(labels, "labels", i));
+                colorMaps.push_back(write(colors, "colors", i));
+            }
+        }
+
+        /**
+         * Deletes the files of the dataset.
+         */
+        ~SyntheticDataset() {
+            for (auto i = files.begin(); i != files.end(); i++) {
+                std::remove(i->c_str());
+            }
+        }
+
+        /**
+         * The filenames of the RGB images.
+         */
+        std::vector<std::string> images;
+        /**
+         * The filenames of the label images.
+         */
+        std::vector<std::string> labelMaps;
+        /**
+         * The filenames of the color encoded label images.
+         */
+        std::vector<std::string> colorMaps;
+        /**
+         * Maps the values of the label images to classes.
+         */
+        std::array<uchar, 256> valueMap;
+        /**
+         * Maps the colors of the color encoded label images to classes.
+         */
+        std::unordered_map<cv::Vec3b, uchar> colorMap;
+
+    private:
+        /**
+         * Writes an image as PNG file.
+         *
+         * @param image The image.
+         * @param kind The kind of the image.
+         * @param index The index of the sample.
+         * @return The filename.
+         */
+        std::string write(const cv::Mat & image, const char * kind, int index) {
+            std::stringstream filename;
+            filename << directory << "/" << kind << "_" << index << ".png";
+            if (!cv::imwrite(filename.str(), image)) {
+                throw std::runtime_error("Could not write " + filename.str());
+            }
+            files.push_back(filename.str());
+            return filename.str();
+        }
+
+        /**
+         * The directory of the files.
+         */
+        std::string directory;
+        /**
+         * The color of each class.
+         */
+        std::vector<cv::Vec3b> palette;
+        /**
+         * All files written.
+         */
+        std::vector<std::string> files;
+    };
+
+    /**
+     * Benchmarks loading a file.
+     *
+     * @param results The list to append the results to.
+     * @param settings The settings.
+     * @param name The name of the loader.
+     * @param loader The loader.
+     * @param filenames The files to load in turn.
+     * @param size The image size.
+     * @param numClasses The number of classes or 0.
+     */
+    void benchmarkLoader(
+            std::vector<Result> & results,
+            const Settings & settings,
+            const std::string & name,
+            const LoaderInterface & loader,
+            const std::vector<std::string> & filenames,
+            const std::array<int, 2> & size,
+            int numClasses) {
+        size_t next = 0;
+        cv::Mat image;
+        results.push_back(measure("loader", name, size[0], size[1], numClasses,
+                settings.minTime,
+                [&next]() {
+                    next++;
+                },
+                [&]() {
+                    image = loader.load(filenames[next % filenames.size()]);
+                }));
+        report(results.back());
+    }
+
+    /**
+     * Benchmarks an augmentor on a copy of the same pair in every iteration.
+     *
+     * @param results The list to append the results to.
+     * @param settings The settings.
+     * @param name The name of the augmentor.
+     * @param augmentor The augmentor.
+     * @param pair The pair to augment.
+     * @param numClasses The number of classes or 0.
+     */
+    void benchmarkAugmentor(
+            std::vector<Result> & results,
+            const Settings & settings,
+            const std::string & name,
+            AugmentorInterface & augmentor,
+            const ImageTargetPair & pair,
+            int numClasses) {
+        ImageTargetPair copy;
+        results.push_back(measure("augmentor", name,
+                pair.image.rows, pair.image.cols, numClasses, settings.minTime,
+                [&]() {
+                    copy.image = pair.image.clone();
+                    copy.target = pair.target.clone();
+                },
+                [&]() {
+                    augmentor.augment(copy);
+                }));
+        report(results.back());
+    }
+
+    /**
+     * Benchmarks a collation kernel.
+     *
+     * @param results The list to append the results to.
+     * @param settings The settings.
+     * @param name The name of the kernel.
+     * @param image The CV_32FC3 image to collate.
+     * @param kernel The kernel.
+     */
+    template <class T>
+    void benchmarkCollate(
+            std::vector<Result> & results,
+            const Settings & settings,
+            const std::string & name,
+            const cv::Mat & image,
+            void (*kernel)(const cv::Mat &, T *)) {
+        std::vector<T> dest(3 * image.total());
+        results.push_back(measure("collate", name, image.rows, image.cols, 0,
+                settings.minTime,
+                []() {},
+                [&]() {
+                    kernel(image, dest.data());
+                }));
+        report(results.back());
+    }
+
+    /**
+     * Benchmarks the target encoding of a data provider by running it over
+     * the dataset and reading the counters of its "encode" stage. The
+     * encoding is private to the provider, so it is measured in place.
+     *
+     * @param results The list to append the results to.
+     * @param settings The settings.
+     * @param name The name of the encoding.
+     * @param dataset The dataset.
+     * @param size The image size.
+     * @param numClasses The number of classes.
+     * @param format The target format.
+     * @param layout The layout.
+     */
+    void benchmarkEncode(
+            std::vector<Result> & results,
+            const Settings & settings,
+            const std::string & name,
+            const SyntheticDataset & dataset,
+            const std::array<int, 2> & size,
+            int numClasses,
+            TargetFormat format,
+            Layout layout) {
+        IteratorInterface::ContainerPtr files(new std::vector<FilenamePair>());
+        for (size_t i = 0; i < dataset.images.size(); i++) {
+            files->push_back({dataset.images[i], dataset.labelMaps[i]});
+        }
+
+        // A single sample per batch keeps large one-hot tensors affordable
+        auto loader = std::make_shared<ImageTargetPairLoader>(
+                std::make_shared<RGBLoader>(),
+                std::make_shared<LabelLoader>());
+        DataProvider provider(nullptr, loader,
+                std::make_shared<SequentialIterator>(std::move(files)),
+                1, numClasses);
+        provider.setNumWorkers(1);
+        provider.setTargetFormat(format);
+        provider.setLayout(layout);
+        provider.init();
+
+        // Skip the batches that were loaded before the clock started
+        provider.next();
+        provider.clearStats();
+
+        const auto start = std::chrono::steady_clock::now();
+        do {
+            provider.next();
+        } while (std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count() <
+                settings.minTime);
+
+        auto stages = provider.getStats();
+        for (auto i = stages.begin(); i != stages.end(); i++) {
+            if (i->name == "encode" && i->count > 0) {
+                Result result = {
+                    "encode", name, size[0], size[1], numClasses, i->count,
+                    1e6 * i->totalSeconds / i->count, -1, -1
+                };
+                results.push_back(result);
+                report(result);
+            }
+        }
+    }
+
+    /**
+     * Runs all benchmarks for one image size and number of classes.
+     *
+     * @param results The list to append the results to.
+     * @param settings The settings.
+     * @param size The image size.
+     * @param numClasses The number of classes.
+     * @param first True for the first number of classes of this size.
+     *              Benchmarks that do not depend on the number of classes
+     *              only run then.
+     */
+    void benchmarkConfiguration(
+            std::vector<Result> & results,
+            const Settings & settings,
+            const std::array<int, 2> & size,
+            int numClasses,
+            bool first) {
+        SyntheticDataset dataset(
+                settings.directory, size[0], size[1], numClasses);
+
+        // Loaders
+        RGBLoader rgbLoader;
+        LabelLoader labelLoader;
+        ValueMapperLoader valueLoader(dataset.valueMap);
+        ColorMapperLoader colorLoader(dataset.colorMap);
+        if (first) {
+            benchmarkLoader(results, settings, "RGBLoader", rgbLoader,
+                    dataset.images, size, 0);
+            benchmarkLoader(results, settings, "LabelLoader", labelLoader,
+                    dataset.labelMaps, size, 0);
+        }
+        benchmarkLoader(results, settings, "ValueMapperLoader", valueLoader,
+                dataset.labelMaps, size, numClasses);
+        benchmarkLoader(results, settings, "ColorMapperLoader", colorLoader,
+                dataset.colorMaps, size, numClasses);
+
+        const ImageTargetPair pair = {
+            rgbLoader.load(dataset.images[0]),
+            labelLoader.load(dataset.labelMaps[0])
+        };
+
+        // Augmentors. Only cropping depends on the number of classes.
+        const int seed = 1;
+        if (first) {
+            std::vector<std::pair<std::string,
+                    std::shared_ptr<AugmentorInterface>>> augmentors = {
+                {"SubsampleAugmentor",
+                        std::make_shared<SubsampleAugmentor>(2)},
+                {"GammaAugmentor",
+                        std::make_shared<GammaAugmentor>(0.3, seed)},
+                {"TranslationAugmentor",
+                        std::make_shared<TranslationAugmentor>(
+                        size[1] / 8, seed)},
+                {"ZoomingAugmentor",
+                        std::make_shared<ZoomingAugmentor>(0.3, seed)},
+                {"RotationAugmentor",
+                        std::make_shared<RotationAugmentor>(10, seed)},
+                {"SaturationAugmentor",
+                        std::make_shared<SaturationAugmentor>(0.5, 1.5, seed)},
+                {"HueAugmentor",
+                        std::make_shared<HueAugmentor>(-30, 30, seed)}
+            };
+            for (auto i = augmentors.begin(); i != augmentors.end(); i++) {
+                benchmarkAugmentor(results, settings, i->first, *i->second,
+                        pair, 0);
+            }
+        }
+        CropAugmentor crop(std::min(size[0], size[1]) / 2, numClasses, seed);
+        benchmarkAugmentor(results, settings, "CropAugmentor", crop, pair,
+                numClasses);
+
+        // Collation kernels
+        if (first) {
+            benchmarkCollate<float>(results, settings,
+                    "interleavedToPlanar.float32", pair.image,
+                    &interleavedToPlanar);
+            benchmarkCollate<float16>(results, settings,
+                    "interleavedToPlanar.float16", pair.image,
+                    &interleavedToPlanar);
+            benchmarkCollate<uchar>(results, settings,
+                    "interleavedToPlanar.uint8", pair.image,
+                    &interleavedToPlanar);
+            benchmarkCollate<float>(results, settings,
+                    "copyInterleaved.float32", pair.image, &copyInterleaved);
+            benchmarkCollate<float16>(results, settings,
+                    "copyInterleaved.float16", pair.image, &copyInterleaved);
+            benchmarkCollate<uchar>(results, settings,
+                    "copyInterleaved.uint8", pair.image, &copyInterleaved);
+        }
+
+        // Target encodings
+        benchmarkEncode(results, settings, "OneHot.NCHW", dataset, size,
+                numClasses, TargetFormat::OneHot, Layout::NCHW);
+        benchmarkEncode(results, settings, "OneHot.NHWC", dataset, size,
+                numClasses, TargetFormat::OneHot, Layout::NHWC);
+        benchmarkEncode(results, settings, "UInt8Labels", dataset, size,
+                numClasses, TargetFormat::UInt8Labels, Layout::NCHW);
+        benchmarkEncode(results, settings, "Int32Labels", dataset, size,
+                numClasses, TargetFormat::Int32Labels, Layout::NCHW);
+    }
+
+    /**
+     * Writes the results as JSON.
+     *
+     * @param stream The stream to write to.
+     * @param settings The settings.
+     * @param results The results.
+     */
+    void writeJson(
+            std::ostream & stream,
+            const Settings & settings,
+            const std::vector<Result> & results) {
+        stream.precision(6);
+        stream << std::fixed;
+        stream << "{\n  \"min_time\": " << settings.minTime
+                << ",\n  \"benchmarks\": [";
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result & r = results[i];
+            stream << (i > 0 ? ",\n" : "\n") << "    {"
+                    << "\"group\": \"" << r.group << "\", "
+                    << "\"name\": \"" << r.name << "\", "
+                    << "\"height\": " << r.height << ", "
+                    << "\"width\": " << r.width << ", "
+                    << "\"num_classes\": " << r.numClasses << ", "
+                    << "\"iterations\": " << r.iterations << ", "
+                    << "\"mean_us\": " << r.meanMicros;
+            if (r.minMicros >= 0) {
+                stream << ", \"min_us\": " << r.minMicros
+                        << ", \"median_us\": " << r.medianMicros;
+            }
+            stream << "}";
+        }
+        stream << "\n  ]\n}\n";
+    }
+
+    /**
+     * Parses the command line.
+     *
+     * @param argc The number of arguments.
+     * @param argv The arguments.
+     * @return The settings.
+     */
+    Settings parseArguments(int argc, char ** argv) {
+        Settings settings;
+        settings.minTime = 0.2;
+        settings.sizes = {{{128, 128}}, {{256, 256}}, {{512, 512}}};
+        settings.classCounts = {2, 21, 150};
+
+        for (int i = 1; i < argc; i++) {
+            const std::string arg = argv[i];
+            const bool hasValue = i + 1 < argc;
+            if (arg == "--output" && hasValue) {
+                settings.output = argv[++i];
+            } else if (arg == "--dir" && hasValue) {
+                settings.directory = argv[++i];
+            } else if (arg == "--min-time" && hasValue) {
+                settings.minTime = std::atof(argv[++i]);
+            } else if (arg == "--quick") {
+                settings.minTime = 0.02;
+                settings.sizes = {{{64, 64}}, {{128, 128}}};
+                settings.classCounts = {2, 21};
+            } else {
+                std::stringstream error;
+                error << "Unknown argument '" << arg << "'. Usage: "
+                        << argv[0] << " [--output FILE] [--dir DIR] "
+                        << "[--min-time SECONDS] [--quick]";
+                throw std::runtime_error(error.str());
+            }
+        }
+        return settings;
+    }
+
+} // namespace
+
+int main(int argc, char ** argv) {
+    try {
+        Settings settings = parseArguments(argc, argv);
+
+        // The dataset goes to a fresh temporary directory unless one is given
+        bool ownDirectory = false;
+        if (settings.directory.empty()) {
+            const char * tmp = std::getenv("TMPDIR");
+            std::string pattern = std::string(tmp != nullptr ? tmp : "/tmp")
+                    + "/chianti_bench_XXXXXX";
+            std::vector<char> buffer(pattern.begin(), pattern.end());
+            buffer.push_back('\0');
+            if (mkdtemp(buffer.data()) == nullptr) {
+                throw std::runtime_error("Could not create a temporary "
+                        "directory.");
+            }
+            settings.directory = buffer.data();
+            ownDirectory = true;
+        }
+
+        std::vector<Result> results;
+        for (auto size = settings.sizes.begin();
+                size != settings.sizes.end(); size++) {
+            for (size_t c = 0; c < settings.classCounts.size(); c++) {
+                benchmarkConfiguration(results, settings, *size,
+                        settings.classCounts[c], c == 0);
+            }
+        }
+
+        if (ownDirectory) {
+            rmdir(settings.directory.c_str());
+        }
+
+        if (settings.output.empty()) {
+            writeJson(std::cout, settings, results);
+        } else {
+            std::ofstream file(settings.output.c_str());
+            writeJson(file, settings, results);
+            if (!file) {
+                throw std::runtime_error("Could not write " + settings.output);
+            }
+        }
+    } catch (const std::exception & e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
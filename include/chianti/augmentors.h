@@ -10,12 +10,15 @@
 #define CHIANTI_AUGMENTORS_H
 
 #include <array>
+#include <atomic>
 #include <random>
 #include <memory>
-#include <mutex>
+#include <string>
 
 #include <opencv2/opencv.hpp>
 
+#include "random.h"
+#include "stats.h"
 #include "types.h"
 
 namespace chianti {
@@ -31,6 +34,117 @@ namespace chianti {
          * @param pair the pair to augment.
          */
         virtual void augment(ImageTargetPair & pair) = 0;
+        
+        /**
+         * Augments an image/label pair. All random numbers are drawn from the
+         * given engine, so the result only depends on the pair and the state
+         * of the engine. Augmentors that do not override this ignore the 
+         * engine and are not deterministic.
+         * 
+         * @param pair the pair to augment.
+         * @param g The random engine to draw from.
+         */
+        virtual void augment(ImageTargetPair & pair, RandomEngine & g) {
+            augment(pair);
+        }
+        
+        /**
+         * Returns the name of the augmentor.
+         * 
+         * @return The name of the augmentor.
+         */
+        virtual std::string getName() const {
+            return "Augmentor";
+        }
+        
+        /**
+         * Registers the stages of the augmentor with the given statistics. 
+         * Augmentors that consist of several steps record the time of each 
+         * step. The augmentor keeps the statistics alive. Must not be called
+         * while the augmentor is in use.
+         * 
+         * @param stats The statistics to record in.
+         * @param prefix The prefix of the stage names.
+         */
+        virtual void instrument(
+                std::shared_ptr<Stats> stats, 
+                const std::string & prefix) {
+        }
+        
+        /**
+         * Returns the factor by which the augmentor downscales the image 
+         * before doing anything else. The loader then decodes the image at 
+         * the reduced scale directly where possible, and the augmentor only 
+         * has to process the target.
+         * 
+         * @return The factor or 1 if the image can be decoded as is.
+         */
+        virtual int getDecodeReduction() const {
+            return 1;
+        }
+        
+        /**
+         * Returns true if the augmentor does not draw random numbers, so its
+         * output only depends on the pair. The output of deterministic 
+         * augmentors can be cached.
+         * 
+         * @return Whether the augmentor is deterministic.
+         */
+        virtual bool isDeterministic() const {
+            return false;
+        }
+        
+        /**
+         * Returns the name of the augmentor together with the parameters 
+         * that determine its output. Shard caches are keyed by the 
+         * description of their preprocessor, so deterministic augmentors 
+         * must describe all of their parameters.
+         * 
+         * @return The description of the augmentor.
+         */
+        virtual std::string getDescription() const {
+            return getName();
+        }
+    };
+
+    /**
+     * Base class for augmentors that draw random numbers. When no engine is 
+     * given, each call draws from its own stream under the augmentor's seed.
+     * Claiming a stream is a single atomic increment, so concurrent calls 
+     * never wait for each other.
+     */
+    class RandomAugmentor : public AugmentorInterface {
+    public:
+        using AugmentorInterface::augment;
+
+        /**
+         * Augments an image/label pair using the next stream of the 
+         * augmentor.
+         * 
+         * @param pair the pair to augment.
+         */
+        void augment(ImageTargetPair & pair);
+
+    protected:
+        /**
+         * Initializes a new instance of the RandomAugmentor class.
+         * 
+         * @param _seed The random seed
+         */
+        explicit RandomAugmentor(int _seed) : 
+        seed(static_cast<uint32_t>(_seed)), 
+        nextStream(0) {
+        }
+
+    private:
+        /**
+         * The random seed
+         */
+        const uint32_t seed;
+        /**
+         * The index of the next random stream
+         */
+        std::atomic<uint64_t> nextStream;
     };
 
     /**
@@ -53,15 +167,78 @@ namespace chianti {
          */
         void augment(ImageTargetPair & pair);
 
+        /**
+         * Augments an image/label pair. Each augmentor draws from its own 
+         * sub-stream of the engine, so its random numbers do not depend on 
+         * the augmentors that precede it.
+         * 
+         * @param pair the pair to augment.
+         * @param g The random engine to draw from.
+         */
+        void augment(ImageTargetPair & pair, RandomEngine & g);
+
+        /**
+         * Returns the name of the augmentor.
+         * 
+         * @return The name of the augmentor.
+         */
+        std::string getName() const {
+            return "CombinedAugmentor";
+        }
+
+        /**
+         * Returns the decode reduction of the first augmentor.
+         * 
+         * @return The factor or 1.
+         */
+        int getDecodeReduction() const {
+            return augmentors.empty() ? 1 : augmentors[0]->getDecodeReduction();
+        }
+
+        /**
+         * Returns true if all augmentors are deterministic.
+         * 
+         * @return Whether the augmentor is deterministic.
+         */
+        bool isDeterministic() const;
+
+        /**
+         * Describes the augmentors in the order in which they are applied.
+         * 
+         * @return The description of the augmentor.
+         */
+        std::string getDescription() const;
+
+        /**
+         * Records the time of each augmentor in a stage named 
+         * prefix + index + "." + name.
+         * 
+         * @param stats The statistics to record in.
+         * @param prefix The prefix of the stage names.
+         */
+        void instrument(
+                std::shared_ptr<Stats> stats, 
+                const std::string & prefix);
+
     private:
         /**
          * The individual augmentation steps.
          */
         std::vector<std::shared_ptr<AugmentorInterface>> augmentors;
+        /**
+         * The stage of each augmentation step. Empty if the augmentor has not
+         * been instrumented.
+         */
+        std::vector<StageStats*> stages;
+        /**
+         * The statistics the stages belong to.
+         */
+        std::shared_ptr<Stats> stats;
     };
 
     /**
-     * Subsamples the pair by a given factor.
+     * Subsamples the pair by a given factor. If the image has already been 
+     * decoded at the reduced scale, only the target is subsampled.
      */
     class SubsampleAugmentor : public AugmentorInterface {
     public:
@@ -74,11 +251,52 @@ namespace chianti {
          * 
          * @param pair the pair to augment.
          */
-        void augment(ImageTargetPair & pair) {
-            resizeImage(pair.image);
-            resizeTarget(pair.target);
+        void augment(ImageTargetPair & pair);
+
+        /**
+         * Augments an image/label pair. Subsampling does not draw random 
+         * numbers.
+         * 
+         * @param pair the pair to augment.
+         */
+        void augment(ImageTargetPair & pair, RandomEngine &) {
+            augment(pair);
+        }
+
+        /**
+         * Returns the name of the augmentor.
+         * 
+         * @return The name of the augmentor.
+         */
+        std::string getName() const {
+            return "SubsampleAugmentor";
+        }
+
+        /**
+         * Returns the factor if JPEG decoders can scale by it.
+         * 
+         * @return The factor if it is 2, 4 or 8 and 1 otherwise.
+         */
+        int getDecodeReduction() const {
+            return factor == 2 || factor == 4 || factor == 8 ? factor : 1;
         }
 
+        /**
+         * Subsampling is deterministic.
+         * 
+         * @return True.
+         */
+        bool isDeterministic() const {
+            return true;
+        }
+
+        /**
+         * Describes the augmentor including the factor.
+         * 
+         * @return The description of the augmentor.
+         */
+        std::string getDescription() const;
+
     private:
         /**
          * Resizes the image.
@@ -99,7 +317,7 @@ namespace chianti {
     /**
      * Performs random gamma augmentation on the image.
      */
-    class GammaAugmentor : public AugmentorInterface {
+    class GammaAugmentor : public RandomAugmentor {
     public:
 
         /**
@@ -126,26 +344,30 @@ namespace chianti {
          * @param seed The random seed
          */
         GammaAugmentor(double strength, int seed) :
-        g(seed),
+        RandomAugmentor(seed),
         d(std::max(-0.5, -strength), std::min(0.5, strength)) {
         }
 
+        using RandomAugmentor::augment;
+
         /**
          * Augments an image/label pair.
          * 
          * @param pair the pair to augment.
+         * @param g The random engine to draw from.
          */
-        void augment(ImageTargetPair & pair);
+        void augment(ImageTargetPair & pair, RandomEngine & g);
 
-    private:
         /**
-         * Mutex for access to the RNG
-         */
-        std::mutex rngMutex;
-        /**
-         * Random number generator
+         * Returns the name of the augmentor.
+         * 
+         * @return The name of the augmentor.
          */
-        std::mt19937 g;
+        std::string getName() const {
+            return "GammaAugmentor";
+        }
+
+    private:
         /**
          * Source distribution
          */
@@ -155,7 +377,7 @@ namespace chianti {
     /**
      * Performs random translation augmentation on the image.
      */
-    class TranslationAugmentor : public AugmentorInterface {
+    class TranslationAugmentor : public RandomAugmentor {
     public:
 
         /**
@@ -180,26 +402,30 @@ namespace chianti {
          * @param seed The random seed
          */
         TranslationAugmentor(int offset, int seed) :
-        g(seed),
+        RandomAugmentor(seed),
         d(-std::abs(offset), std::abs(offset)) {
         }
 
+        using RandomAugmentor::augment;
+
         /**
          * Augments an image/label pair.
          * 
          * @param pair the pair to augment.
+         * @param g The random engine to draw from.
          */
-        void augment(ImageTargetPair & pair);
+        void augment(ImageTargetPair & pair, RandomEngine & g);
 
-    private:
-        /**
-         * Mutex for access to the RNG
-         */
-        std::mutex rngMutex;
         /**
-         * Random number generator
+         * Returns the name of the augmentor.
+         * 
+         * @return The name of the augmentor.
          */
-        std::mt19937 g;
+        std::string getName() const {
+            return "TranslationAugmentor";
+        }
+
+    private:
         /**
          * Source distribution
          */
@@ -209,7 +435,7 @@ namespace chianti {
     /**
      * Randomly zooms into/out of the image.
      */
-    class ZoomingAugmentor : public AugmentorInterface {
+    class ZoomingAugmentor : public RandomAugmentor {
     public:
 
         /**
@@ -234,26 +460,30 @@ namespace chianti {
          * @param seed The random seed
          */
         ZoomingAugmentor(double factor, int seed) :
-        g(seed),
+        RandomAugmentor(seed),
         d(1 - factor, 1 + factor) {
         }
 
+        using RandomAugmentor::augment;
+
         /**
          * Augments an image/label pair.
          * 
          * @param pair the pair to augment.
+         * @param g The random engine to draw from.
          */
-        void augment(ImageTargetPair & pair);
+        void augment(ImageTargetPair & pair, RandomEngine & g);
 
-    private:
         /**
-         * Mutex for access to the RNG
-         */
-        std::mutex rngMutex;
-        /**
-         * Random number generator
+         * Returns the name of the augmentor.
+         * 
+         * @return The name of the augmentor.
          */
-        std::mt19937 g;
+        std::string getName() const {
+            return "ZoomingAugmentor";
+        }
+
+    private:
         /**
          * Source distribution
          */
@@ -263,7 +493,7 @@ namespace chianti {
     /**
      * Randomly rotates the image.
      */
-    class RotationAugmentor : public AugmentorInterface {
+    class RotationAugmentor : public RandomAugmentor {
     public:
 
         /**
@@ -288,26 +518,30 @@ namespace chianti {
          * @param seed The random seed
          */
         RotationAugmentor(double maxAngel, int seed) :
-        g(seed),
+        RandomAugmentor(seed),
         d(-maxAngel, maxAngel) {
         }
 
+        using RandomAugmentor::augment;
+
         /**
          * Augments an image/label pair.
          * 
          * @param pair the pair to augment.
+         * @param g The random engine to draw from.
          */
-        void augment(ImageTargetPair & pair);
+        void augment(ImageTargetPair & pair, RandomEngine & g);
 
-    private:
         /**
-         * Mutex for access to the RNG
-         */
-        std::mutex rngMutex;
-        /**
-         * Random number generator
+         * Returns the name of the augmentor.
+         * 
+         * @return The name of the augmentor.
          */
-        std::mt19937 g;
+        std::string getName() const {
+            return "RotationAugmentor";
+        }
+
+    private:
         /**
          * Source distribution
          */
@@ -317,7 +551,7 @@ namespace chianti {
     /**
      * Randomly adjusts the image Saturation.
      */
-    class SaturationAugmentor : public AugmentorInterface {
+    class SaturationAugmentor : public RandomAugmentor {
     public:
 
         /**
@@ -344,26 +578,30 @@ namespace chianti {
          * @param seed The random seed
          */
         SaturationAugmentor(double delta_min, double delta_max, int seed) :
-        g(seed),
+        RandomAugmentor(seed),
         d(delta_min, delta_max) {
         }
 
+        using RandomAugmentor::augment;
+
         /**
          * Augments an image/label pair.
          * 
          * @param pair the pair to augment.
+         * @param g The random engine to draw from.
          */
-        void augment(ImageTargetPair & pair);
+        void augment(ImageTargetPair & pair, RandomEngine & g);
 
-    private:
         /**
-         * Mutex for access to the RNG
-         */
-        std::mutex rngMutex;
-        /**
-         * Random number generator
+         * Returns the name of the augmentor.
+         * 
+         * @return The name of the augmentor.
          */
-        std::mt19937 g;
+        std::string getName() const {
+            return "SaturationAugmentor";
+        }
+
+    private:
         /**
          * Source distribution
          */
@@ -373,7 +611,7 @@ namespace chianti {
     /**
      * Randomly adjusts the image Hue.
      */
-    class HueAugmentor : public AugmentorInterface {
+    class HueAugmentor : public RandomAugmentor {
     public:
 
         /**
@@ -400,26 +638,30 @@ namespace chianti {
          * @param seed The random seed
          */
         HueAugmentor(double delta_min, double delta_max, int seed) :
-        g(seed),
+        RandomAugmentor(seed),
         d(delta_min, delta_max) {
         }
 
+        using RandomAugmentor::augment;
+
         /**
          * Augments an image/label pair.
          * 
          * @param pair the pair to augment.
+         * @param g The random engine to draw from.
          */
-        void augment(ImageTargetPair & pair);
+        void augment(ImageTargetPair & pair, RandomEngine & g);
 
-    private:
-        /**
-         * Mutex for access to the RNG
-         */
-        std::mutex rngMutex;
         /**
-         * Random number generator
+         * Returns the name of the augmentor.
+         * 
+         * @return The name of the augmentor.
          */
-        std::mt19937 g;
+        std::string getName() const {
+            return "HueAugmentor";
+        }
+
+    private:
         /**
          * Source distribution
          */
@@ -431,7 +673,7 @@ namespace chianti {
      * with a probability proportional to the entropy of their class 
      * distributions.
      */
-    class CropAugmentor : public AugmentorInterface {
+    class CropAugmentor : public RandomAugmentor {
     public:
 
         /**
@@ -452,18 +694,30 @@ namespace chianti {
          * @param seed The random seed
          */
         CropAugmentor(int size, int numClasses, int seed) :
-        g(seed),
+        RandomAugmentor(seed),
         d(0, 1), 
         size(size),
         numClasses(numClasses) {
         }
 
+        using RandomAugmentor::augment;
+
         /**
          * Augments an image/label pair.
          * 
          * @param pair the pair to augment.
+         * @param g The random engine to draw from.
          */
-        void augment(ImageTargetPair & pair);
+        void augment(ImageTargetPair & pair, RandomEngine & g);
+
+        /**
+         * Returns the name of the augmentor.
+         * 
+         * @return The name of the augmentor.
+         */
+        std::string getName() const {
+            return "CropAugmentor";
+        }
 
     private:
         /**
@@ -514,16 +768,8 @@ namespace chianti {
          * Samples the position of a crop based on the cumulative distribution.
          */
         std::array<int, 2> samplePosition(const cv::Mat & target, 
-                const cv::Mat & distribution);
+                const cv::Mat & distribution, RandomEngine & g) const;
         
-        /**
-         * Mutex for access to the RNG
-         */
-        std::mutex rngMutex;
-        /**
-         * Random number generator
-         */
-        std::mt19937 g;
         /**
          * Source distribution
          */
@@ -12,12 +12,22 @@
 #include <opencv2/opencv.hpp>
 
 #include <array>
+#include <atomic>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <tuple>
+#include <typeinfo>
 #include <unordered_map>
+#include <vector>
 
 #include "types.h"
 #include "iterators.h"
+#include "sources.h"
+#include "stats.h"
 
 namespace std {
 
@@ -54,6 +64,70 @@ namespace chianti {
          * @return The loaded image.
          */
         virtual cv::Mat load(const std::string & filename) const = 0;
+
+        /**
+         * Takes a filename and returns the image downscaled by the given 
+         * factor, if the loader can decode it at a reduced scale directly. 
+         * This is much cheaper than decoding at full resolution and resizing
+         * afterwards.
+         * 
+         * @param filename The image file to load.
+         * @param factor The downscaling factor (2, 4 or 8).
+         * @param size Set to the size of the image at full resolution.
+         * @return The loaded image or an empty image if the file cannot be 
+         *         decoded at a reduced scale.
+         */
+        virtual cv::Mat loadReduced(
+                const std::string & filename, 
+                int factor, 
+                cv::Size & size) const {
+            return cv::Mat();
+        }
+
+        /**
+         * Decodes an image that has already been read into memory, e.g. 
+         * from a pack file.
+         * 
+         * @param buffer The encoded image.
+         * @param name The name of the image for error messages.
+         * @return The decoded image.
+         */
+        virtual cv::Mat decode(
+                const std::vector<uchar> & buffer, 
+                const std::string & name) const {
+            throw std::runtime_error("The loader cannot decode '" + name + 
+                    "' from memory.");
+        }
+
+        /**
+         * Decodes an image that has already been read into memory at a 
+         * reduced scale.
+         * 
+         * @param buffer The encoded image.
+         * @param name The name of the image for error messages.
+         * @param factor The downscaling factor (2, 4 or 8).
+         * @param size Set to the size of the image at full resolution.
+         * @return The decoded image or an empty image if the image cannot be
+         *         decoded at a reduced scale.
+         */
+        virtual cv::Mat decodeReduced(
+                const std::vector<uchar> & buffer, 
+                const std::string & name, 
+                int factor, 
+                cv::Size & size) const {
+            return cv::Mat();
+        }
+
+        /**
+         * Returns the name of the loader together with the parameters that 
+         * determine its output. Shard caches are keyed by the descriptions 
+         * of their loaders, so loaders with parameters must describe them.
+         * 
+         * @return The description of the loader.
+         */
+        virtual std::string getDescription() const {
+            return typeid(*this).name();
+        }
     };
 
     /**
@@ -70,6 +144,57 @@ namespace chianti {
          * @return The loaded image.
          */
         cv::Mat _load(const std::string & filename, bool color) const;
+
+        /**
+         * Loads the given JPEG image at a reduced scale using the DCT domain
+         * scaling of the decoder.
+         * 
+         * @param filename The filename of the image to load.
+         * @param color True if this shall be loaded as color image.
+         * @param factor The downscaling factor (2, 4 or 8).
+         * @param size Set to the size of the image at full resolution, which
+         *             is read from the JPEG header.
+         * @return The loaded image or an empty image if the file is not a 
+         *         JPEG image or the factor is not supported.
+         */
+        cv::Mat _loadReduced(
+                const std::string & filename, 
+                bool color, 
+                int factor, 
+                cv::Size & size) const;
+
+        /**
+         * Decodes the given encoded image and throws an error if it cannot 
+         * be decoded.
+         * 
+         * @param buffer The encoded image.
+         * @param name The name of the image for error messages.
+         * @param color True if this shall be decoded as color image.
+         * @return The decoded image.
+         */
+        cv::Mat _decode(
+                const std::vector<uchar> & buffer, 
+                const std::string & name, 
+                bool color) const;
+
+        /**
+         * Decodes the given encoded JPEG image at a reduced scale.
+         * 
+         * @param buffer The encoded image.
+         * @param name The name of the image for error messages.
+         * @param color True if this shall be decoded as color image.
+         * @param factor The downscaling factor (2, 4 or 8).
+         * @param size Set to the size of the image at full resolution, which
+         *             is read from the JPEG header.
+         * @return The decoded image or an empty image if the buffer does not
+         *         hold a JPEG image or the factor is not supported.
+         */
+        cv::Mat _decodeReduced(
+                const std::vector<uchar> & buffer, 
+                const std::string & name, 
+                bool color, 
+                int factor, 
+                cv::Size & size) const;
     };
 
     /**
@@ -85,6 +210,65 @@ namespace chianti {
          * @return The loaded image.
          */
         cv::Mat load(const std::string & filename) const;
+
+        /**
+         * Takes the filename of a JPEG image and returns the image decoded 
+         * at a reduced scale.
+         * 
+         * @param filename The image file to load.
+         * @param factor The downscaling factor (2, 4 or 8).
+         * @param size Set to the size of the image at full resolution.
+         * @return The loaded image or an empty image.
+         */
+        cv::Mat loadReduced(
+                const std::string & filename, 
+                int factor, 
+                cv::Size & size) const;
+
+        /**
+         * Decodes an image that has already been read into memory.
+         * 
+         * @param buffer The encoded image.
+         * @param name The name of the image for error messages.
+         * @return The decoded image.
+         */
+        cv::Mat decode(
+                const std::vector<uchar> & buffer, 
+                const std::string & name) const;
+
+        /**
+         * Decodes a JPEG image that has already been read into memory at a 
+         * reduced scale.
+         * 
+         * @param buffer The encoded image.
+         * @param name The name of the image for error messages.
+         * @param factor The downscaling factor (2, 4 or 8).
+         * @param size Set to the size of the image at full resolution.
+         * @return The decoded image or an empty image.
+         */
+        cv::Mat decodeReduced(
+                const std::vector<uchar> & buffer, 
+                const std::string & name, 
+                int factor, 
+                cv::Size & size) const;
+
+        /**
+         * Returns the description of the loader.
+         * 
+         * @return The description of the loader.
+         */
+        std::string getDescription() const {
+            return "RGBLoader";
+        }
+
+    private:
+        /**
+         * Converts a decoded BGR image to RGB in [0, 1].
+         * 
+         * @param image The decoded image.
+         * @return The converted image.
+         */
+        static cv::Mat convert(const cv::Mat & image);
     };
 
     /**
@@ -99,6 +283,26 @@ namespace chianti {
          * @return The loaded image.
          */
         cv::Mat load(const std::string & filename) const;
+
+        /**
+         * Decodes an image that has already been read into memory.
+         * 
+         * @param buffer The encoded image.
+         * @param name The name of the image for error messages.
+         * @return The decoded image.
+         */
+        cv::Mat decode(
+                const std::vector<uchar> & buffer, 
+                const std::string & name) const;
+
+        /**
+         * Returns the description of the loader.
+         * 
+         * @return The description of the loader.
+         */
+        std::string getDescription() const {
+            return "LabelLoader";
+        }
     };
 
     /**
@@ -130,7 +334,33 @@ namespace chianti {
          */
         cv::Mat load(const std::string & filename) const;
 
+        /**
+         * Decodes an image that has already been read into memory.
+         * 
+         * @param buffer The encoded image.
+         * @param name The name of the image for error messages.
+         * @return The decoded image.
+         */
+        cv::Mat decode(
+                const std::vector<uchar> & buffer, 
+                const std::string & name) const;
+
+        /**
+         * Returns the description of the loader including its value map.
+         * 
+         * @return The description of the loader.
+         */
+        std::string getDescription() const;
+
     private:
+        /**
+         * Re-maps the values of a decoded image in place.
+         * 
+         * @param image The decoded 8-bit image.
+         * @return The image.
+         */
+        cv::Mat map(cv::Mat image) const;
+
         /**
          * This is the underlying value map. 
          */
@@ -167,7 +397,34 @@ namespace chianti {
          */
         cv::Mat load(const std::string & filename) const;
 
+        /**
+         * Decodes an image that has already been read into memory.
+         * 
+         * @param buffer The encoded image.
+         * @param name The name of the image for error messages.
+         * @return The decoded image.
+         */
+        cv::Mat decode(
+                const std::vector<uchar> & buffer, 
+                const std::string & name) const;
+
+        /**
+         * Returns the description of the loader including its color map.
+         * 
+         * @return The description of the loader.
+         */
+        std::string getDescription() const;
+
     private:
+        /**
+         * Maps the colors of a decoded color image to labels.
+         * 
+         * @param image The decoded color image.
+         * @param name The name of the image for error messages.
+         * @return The label image.
+         */
+        cv::Mat map(const cv::Mat & image, const std::string & name) const;
+
         /**
          * This is the underlying value map. 
          */
@@ -175,7 +432,10 @@ namespace chianti {
     };
 
     /**
-     * Loads an image and a target image from disk.
+     * Loads an image and a target image from disk. By default, the image and
+     * target loaders read the files themselves. If a byte source is given, 
+     * the encoded pair is read from the source first and the loaders decode
+     * it from memory.
      */
     class ImageTargetPairLoader {
     public:
@@ -187,20 +447,81 @@ namespace chianti {
         ImageTargetPairLoader(
                 std::shared_ptr<LoaderInterface> _imageLoader,
                 std::shared_ptr<LoaderInterface> _targetLoader) :
+        ImageTargetPairLoader(_imageLoader, _targetLoader, nullptr) {
+        }
+
+        /**
+         * Initializes a new instance of the ImageTargetPairLoader class.
+         * @param _imageLoader The image loader.
+         * @param _targetLoader The target loader
+         * @param _source The source of the encoded pairs or null to let the
+         *                loaders read the files.
+         */
+        ImageTargetPairLoader(
+                std::shared_ptr<LoaderInterface> _imageLoader,
+                std::shared_ptr<LoaderInterface> _targetLoader,
+                std::shared_ptr<ByteSourceInterface> _source) :
         imageLoader(_imageLoader),
-        targetLoader(_targetLoader) {
+        targetLoader(_targetLoader),
+        source(_source),
+        readStage(nullptr),
+        imageStage(nullptr),
+        targetStage(nullptr) {
         }
         
+        /**
+         * Destructor.
+         */
+        virtual ~ImageTargetPairLoader() {}
+        
         /**
          * Loads the image and the target image from disk.
          * 
          * @param filenames The filenames to load.
+         * @param imageReduction If greater than 1, the image is decoded at a
+         *                       scale reduced by this factor where the image
+         *                       loader supports it. The factor that was
+         *                       applied and the full resolution size of 
+         *                       the image are stored in the result.
          * @return The loaded images
          */
-        ImageTargetPair load(
-                IteratorInterface::ElementIterator filenames) const;
+        virtual ImageTargetPair load(
+                IteratorInterface::ElementIterator filenames,
+                int imageReduction = 1) const;
+        
+        /**
+         * Records the time spent loading images and targets in the stages 
+         * "load.image" and "load.target". With a byte source, these stages 
+         * only cover decoding and reading is recorded in "load.read". The 
+         * loader keeps the statistics alive. Must not be called while the 
+         * loader is in use.
+         * 
+         * @param stats The statistics to record in.
+         */
+        virtual void instrument(std::shared_ptr<Stats> stats);
+
+        /**
+         * Returns the descriptions of the image and the target loader. The 
+         * byte source is not part of it, since it does not change the 
+         * loaded pairs.
+         * 
+         * @return The description of the loaders.
+         */
+        std::string getDescription() const;
+        
+    protected:
+        /**
+         * Reads the encoded pair from the byte source and decodes it.
+         * 
+         * @param filenames The filenames to load.
+         * @param imageReduction The factor by which the image may be 
+         *                       downscaled while decoding it.
+         * @return The loaded images
+         */
+        ImageTargetPair decode(
+                IteratorInterface::ElementIterator filenames,
+                int imageReduction) const;
         
-    private:
         /**
          * The image loader.
          */
@@ -209,6 +530,184 @@ namespace chianti {
          * The target loader.
          */
         std::shared_ptr<LoaderInterface> targetLoader;
+        /**
+         * The source of the encoded pairs or null.
+         */
+        std::shared_ptr<ByteSourceInterface> source;
+        /**
+         * The stage of the byte source or null.
+         */
+        StageStats * readStage;
+        /**
+         * The stage of the image loader or null.
+         */
+        StageStats * imageStage;
+        /**
+         * The stage of the target loader or null.
+         */
+        StageStats * targetStage;
+        /**
+         * The statistics the stages belong to.
+         */
+        std::shared_ptr<Stats> stats;
+    };
+
+    /**
+     * Keeps the loaded image/target pairs in memory, so each file is only 
+     * decoded once while the dataset fits into the budget. When the budget 
+     * is exceeded, the least recently used pairs are evicted. The loader can
+     * be used from several threads.
+     * 
+     * Augmentors modify the pairs in place, so every hit returns a copy.
+     */
+    class CachingImageTargetPairLoader : public ImageTargetPairLoader {
+    public:
+        /**
+         * Initializes a new instance of the CachingImageTargetPairLoader 
+         * class.
+         * 
+         * @param _imageLoader The image loader.
+         * @param _targetLoader The target loader
+         * @param _budget The maximum number of bytes of pixel data to keep.
+         */
+        CachingImageTargetPairLoader(
+                std::shared_ptr<LoaderInterface> _imageLoader,
+                std::shared_ptr<LoaderInterface> _targetLoader,
+                size_t _budget) :
+        CachingImageTargetPairLoader(
+                _imageLoader, _targetLoader, nullptr, _budget) {
+        }
+        
+        /**
+         * Initializes a new instance of the CachingImageTargetPairLoader 
+         * class that reads the encoded pairs from a byte source, e.g. a 
+         * pack.
+         * 
+         * @param _imageLoader The image loader.
+         * @param _targetLoader The target loader
+         * @param _source The source of the encoded pairs or null to let the
+         *                loaders read the files.
+         * @param _budget The maximum number of bytes of pixel data to keep.
+         */
+        CachingImageTargetPairLoader(
+                std::shared_ptr<LoaderInterface> _imageLoader,
+                std::shared_ptr<LoaderInterface> _targetLoader,
+                std::shared_ptr<ByteSourceInterface> _source,
+                size_t _budget) :
+        ImageTargetPairLoader(_imageLoader, _targetLoader, _source),
+        budget(_budget),
+        size(0),
+        hits(0),
+        misses(0),
+        hitStage(nullptr) {
+        }
+        
+        /**
+         * Returns a copy of the cached pair or loads it from disk.
+         * 
+         * @param filenames The filenames to load.
+         * @param imageReduction The factor by which the image may be 
+         *                       downscaled while decoding it.
+         * @return The loaded images
+         */
+        ImageTargetPair load(
+                IteratorInterface::ElementIterator filenames,
+                int imageReduction = 1) const;
+        
+        /**
+         * Records the stages of the ImageTargetPairLoader and the time spent
+         * copying cached pairs in the stage "load.cache". 
+         * 
+         * @param stats The statistics to record in.
+         */
+        void instrument(std::shared_ptr<Stats> stats);
+        
+        /**
+         * Returns the number of loads that were served from the cache.
+         * 
+         * @return The number of hits.
+         */
+        uint64_t getNumHits() const {
+            return hits.load(std::memory_order_relaxed);
+        }
+        
+        /**
+         * Returns the number of loads that had to decode the files.
+         * 
+         * @return The number of misses.
+         */
+        uint64_t getNumMisses() const {
+            return misses.load(std::memory_order_relaxed);
+        }
+        
+        /**
+         * Returns the number of bytes of pixel data in the cache.
+         * 
+         * @return The size of the cache.
+         */
+        size_t getSize() const;
+        
+        /**
+         * Removes all pairs from the cache.
+         */
+        void clear();
+        
+    private:
+        /**
+         * Identifies a pair by its filenames and the decode reduction.
+         */
+        typedef std::tuple<std::string, std::string, int> Key;
+        
+        /**
+         * A cached pair.
+         */
+        struct Entry {
+            /**
+             * The key of the pair.
+             */
+            Key key;
+            /**
+             * The pair as returned by the loaders.
+             */
+            ImageTargetPair pair;
+            /**
+             * The number of bytes of pixel data of the pair.
+             */
+            size_t bytes;
+        };
+        
+        /**
+         * The maximum number of bytes of pixel data.
+         */
+        size_t budget;
+        /**
+         * The cached pairs from the most to the least recently used.
+         */
+        mutable std::list<Entry> entries;
+        /**
+         * Maps the keys to the entries.
+         */
+        mutable std::map<Key, std::list<Entry>::iterator> index;
+        /**
+         * The number of bytes of pixel data of all entries.
+         */
+        mutable size_t size;
+        /**
+         * The number of hits.
+         */
+        mutable std::atomic<uint64_t> hits;
+        /**
+         * The number of misses.
+         */
+        mutable std::atomic<uint64_t> misses;
+        /**
+         * The stage of copying cached pairs or null.
+         */
+        StageStats * hitStage;
+        /**
+         * Guards the entries, the index and the size.
+         */
+        mutable std::mutex accessMutex;
     };
 } // namespace chianti
 #endif
\ No newline at end of file
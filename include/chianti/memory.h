@@ -9,7 +9,14 @@
 #ifndef CHIANTI_MEMORY_H
 #define CHIANTI_MEMORY_H
 
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 namespace chianti {
     /**
@@ -19,6 +26,175 @@ namespace chianti {
     std::unique_ptr<T> make_unique(Args&&... args) {
         return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
     }
+    
+    /**
+     * A contiguous buffer of trivially copyable values whose first element is
+     * aligned to a cache line. Unlike std::vector, growing the buffer does not
+     * initialize the new elements and copies are done with a single memcpy.
+     */
+    template<typename T>
+    class AlignedBuffer {
+    public:
+        static_assert(std::is_trivially_copyable<T>::value, 
+                "AlignedBuffer only supports trivially copyable types.");
+        
+        /**
+         * The alignment of the buffer in bytes.
+         */
+        static const std::size_t alignment = 64;
+        
+        /**
+         * Initializes a new instance of the AlignedBuffer class.
+         */
+        AlignedBuffer() : block(nullptr), ptr(nullptr), count(0), capacity(0) {
+        }
+        
+        /**
+         * Copies the buffer.
+         */
+        AlignedBuffer(const AlignedBuffer & other) : AlignedBuffer() {
+            *this = other;
+        }
+        
+        /**
+         * Moves the buffer.
+         */
+        AlignedBuffer(AlignedBuffer && other) noexcept : AlignedBuffer() {
+            swap(other);
+        }
+        
+        /**
+         * Destructor.
+         */
+        ~AlignedBuffer() {
+            std::free(block);
+        }
+        
+        /**
+         * Assignment operator.
+         */
+        AlignedBuffer & operator=(const AlignedBuffer & other) {
+            if (this != &other) {
+                resize(other.count);
+                if (count > 0) {
+                    std::memcpy(ptr, other.ptr, count * sizeof (T));
+                }
+            }
+            return *this;
+        }
+        
+        /**
+         * Move assignment operator.
+         */
+        AlignedBuffer & operator=(AlignedBuffer && other) noexcept {
+            if (this != &other) {
+                AlignedBuffer tmp(std::move(other));
+                swap(tmp);
+            }
+            return *this;
+        }
+        
+        /**
+         * Changes the number of elements. The memory is only reallocated if 
+         * the buffer grows beyond its capacity. In that case, the content is
+         * undefined afterwards.
+         * 
+         * @param newCount The new number of elements.
+         */
+        void resize(std::size_t newCount) {
+            if (newCount > capacity) {
+                std::free(block);
+                block = nullptr;
+                ptr = nullptr;
+                capacity = 0;
+                
+                // The size of the block must not wrap around
+                if (newCount > (SIZE_MAX - alignment) / sizeof (T)) {
+                    count = 0;
+                    throw std::bad_alloc();
+                }
+                
+                // Over-allocate such that we can align the first element
+                block = std::malloc(newCount * sizeof (T) + alignment - 1);
+                if (block == nullptr) {
+                    count = 0;
+                    throw std::bad_alloc();
+                }
+                const auto address = reinterpret_cast<std::uintptr_t>(block);
+                ptr = reinterpret_cast<T*>(
+                        (address + alignment - 1) & ~(alignment - 1));
+                capacity = newCount;
+            }
+            count = newCount;
+        }
+        
+        /**
+         * Exchanges the content of two buffers.
+         */
+        void swap(AlignedBuffer & other) noexcept {
+            std::swap(block, other.block);
+            std::swap(ptr, other.ptr);
+            std::swap(count, other.count);
+            std::swap(capacity, other.capacity);
+        }
+        
+        T * data() {
+            return ptr;
+        }
+        
+        const T * data() const {
+            return ptr;
+        }
+        
+        std::size_t size() const {
+            return count;
+        }
+        
+        T * begin() {
+            return ptr;
+        }
+        
+        const T * begin() const {
+            return ptr;
+        }
+        
+        T * end() {
+            return ptr + count;
+        }
+        
+        const T * end() const {
+            return ptr + count;
+        }
+        
+        T & operator[](std::size_t i) {
+            return ptr[i];
+        }
+        
+        const T & operator[](std::size_t i) const {
+            return ptr[i];
+        }
+        
+    private:
+        /**
+         * The allocated memory block.
+         */
+        void * block;
+        /**
+         * The aligned first element within the block.
+         */
+        T * ptr;
+        /**
+         * The number of elements.
+         */
+        std::size_t count;
+        /**
+         * The number of elements that fit into the block.
+         */
+        std::size_t capacity;
+    };
+    
+    template<typename T>
+    const std::size_t AlignedBuffer<T>::alignment;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,268 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+#ifndef CHIANTI_PACKS_H
+#define CHIANTI_PACKS_H
+
+#include <opencv2/opencv.hpp>
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "iterators.h"
+#include "loaders.h"
+#include "sources.h"
+#include "types.h"
+
+namespace chianti {
+
+    /**
+     * A pack of encoded image/target pairs. The encoded files are 
+     * concatenated in a single data file and an index file maps the 
+     * filenames of each pair to its offset. Reading a pair costs a single 
+     * read at a known offset instead of opening and closing two files, 
+     * which matters for millions of small files on network filesystems.
+     * 
+     * The index is named after the data file with the suffix ".index". The
+     * files use the byte order of the machine that wrote them. The pack can
+     * be read from several threads.
+     */
+    class PackFile : public ByteSourceInterface {
+    public:
+        /**
+         * Opens an existing pack.
+         * 
+         * @param _path The path of the data file.
+         */
+        explicit PackFile(const std::string & _path);
+
+        /**
+         * Closes the data file.
+         */
+        ~PackFile();
+
+        /**
+         * Reads the encoded image and target of a pair and throws an error 
+         * if the pair is not in the pack.
+         * 
+         * @param filenames The filenames of the pair.
+         * @param image The encoded image.
+         * @param target The encoded target.
+         */
+        void read(
+                const FilenamePair & filenames,
+                std::vector<uchar> & image,
+                std::vector<uchar> & target) const;
+
+        /**
+         * Returns true if the pair is in the pack.
+         * 
+         * @param filenames The filenames of the pair.
+         * @return Whether the pair is in the pack.
+         */
+        bool contains(const FilenamePair & filenames) const {
+            return records.find(std::make_pair(
+                    filenames.image, filenames.target)) != records.end();
+        }
+
+        /**
+         * Returns the filenames of all pairs in the order in which they are
+         * stored.
+         * 
+         * @return The filenames.
+         */
+        IteratorInterface::ContainerPtr getFilenames() const;
+
+        /**
+         * Returns the number of pairs in the pack.
+         * 
+         * @return The number of pairs.
+         */
+        size_t getNumPairs() const {
+            return filenames.size();
+        }
+
+    private:
+        PackFile(const PackFile &);
+        PackFile & operator=(const PackFile &);
+
+        /**
+         * The location of an encoded pair. The target follows the image.
+         */
+        struct Record {
+            /**
+             * The offset of the image in the data file.
+             */
+            uint64_t offset;
+            /**
+             * The size of the encoded image in bytes.
+             */
+            uint64_t imageSize;
+            /**
+             * The size of the encoded target in bytes.
+             */
+            uint64_t targetSize;
+        };
+
+        /**
+         * The path of the data file.
+         */
+        std::string path;
+        /**
+         * The descriptor of the data file.
+         */
+        int fd;
+        /**
+         * The filenames of the pairs in the order in which they are stored.
+         */
+        std::vector<FilenamePair> filenames;
+        /**
+         * Maps the filenames of the pairs to their records.
+         */
+        std::map<std::pair<std::string, std::string>, Record> records;
+    };
+
+    /**
+     * Writes a new pack. The index is written when the writer is closed, so 
+     * a pack whose writer did not finish cannot be opened.
+     */
+    class PackWriter {
+    public:
+        /**
+         * Creates the data file. An existing pack is replaced.
+         * 
+         * @param _path The path of the data file.
+         */
+        explicit PackWriter(const std::string & _path);
+
+        /**
+         * Closes the data file without writing the index unless close() has
+         * been called.
+         */
+        ~PackWriter();
+
+        /**
+         * Reads an image file and a target file and appends them to the 
+         * pack. The filenames are stored as given.
+         * 
+         * @param filenames The filenames of the pair.
+         */
+        void add(const FilenamePair & filenames);
+
+        /**
+         * Appends an encoded image/target pair to the pack.
+         * 
+         * @param filenames The filenames the pair is stored under.
+         * @param image The encoded image.
+         * @param target The encoded target.
+         */
+        void add(
+                const FilenamePair & filenames,
+                const std::vector<uchar> & image,
+                const std::vector<uchar> & target);
+
+        /**
+         * Closes the data file and writes the index.
+         */
+        void close();
+
+        /**
+         * Returns the number of pairs added so far.
+         * 
+         * @return The number of pairs.
+         */
+        size_t getNumPairs() const {
+            return filenames.size();
+        }
+
+        /**
+         * Returns the size of the data file so far.
+         * 
+         * @return The size in bytes.
+         */
+        uint64_t getSize() const {
+            return offset;
+        }
+
+    private:
+        PackWriter(const PackWriter &);
+        PackWriter & operator=(const PackWriter &);
+
+        /**
+         * The path of the data file.
+         */
+        std::string path;
+        /**
+         * The data file or null after close().
+         */
+        std::FILE * file;
+        /**
+         * The size of the data file.
+         */
+        uint64_t offset;
+        /**
+         * The filenames of the pairs in the order in which they are stored.
+         */
+        std::vector<FilenamePair> filenames;
+        /**
+         * The offsets of the pairs followed by the sizes of their image and 
+         * target.
+         */
+        std::vector<std::array<uint64_t, 3>> locations;
+        /**
+         * The filenames that have been added. Used to reject duplicates.
+         */
+        std::map<std::pair<std::string, std::string>, size_t> added;
+    };
+
+    /**
+     * Iterates over the pairs of a pack in the order in which they are 
+     * stored, so the data file is read sequentially.
+     */
+    class PackIterator : public SequentialIterator {
+    public:
+        /**
+         * Initializes a new instance of the PackIterator class.
+         * 
+         * @param pack The pack.
+         */
+        explicit PackIterator(const PackFile & pack) :
+        SequentialIterator(pack.getFilenames()) {
+        }
+    };
+
+    /**
+     * Loads image/target pairs from a pack instead of individual files. The
+     * image and target loaders decode the pairs from memory.
+     */
+    class PackImageTargetPairLoader : public ImageTargetPairLoader {
+    public:
+        /**
+         * Initializes a new instance of the PackImageTargetPairLoader class.
+         * 
+         * @param _imageLoader The image loader.
+         * @param _targetLoader The target loader.
+         * @param _pack The pack.
+         */
+        PackImageTargetPairLoader(
+                std::shared_ptr<LoaderInterface> _imageLoader,
+                std::shared_ptr<LoaderInterface> _targetLoader,
+                std::shared_ptr<PackFile> _pack) :
+        ImageTargetPairLoader(_imageLoader, _targetLoader, _pack) {
+        }
+    };
+
+} // namespace chianti
+
+#endif
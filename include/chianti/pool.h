@@ -0,0 +1,121 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+#ifndef CHIANTI_POOL_H
+#define CHIANTI_POOL_H
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "types.h"
+
+namespace chianti {
+
+    class BatchPool;
+
+    /**
+     * Deleter for batches that were handed out by a BatchPool. Instead of 
+     * freeing the batch, it is returned to the pool. If the pool does not 
+     * exist anymore, the batch is freed.
+     */
+    class BatchRecycler {
+    public:
+        /**
+         * Initializes a new instance of the BatchRecycler class that frees
+         * the batch.
+         */
+        BatchRecycler() {}
+
+        /**
+         * Initializes a new instance of the BatchRecycler class.
+         * 
+         * @param _pool The pool to return the batch to.
+         */
+        explicit BatchRecycler(std::weak_ptr<BatchPool> _pool) : 
+        pool(_pool) {}
+
+        /**
+         * Returns the batch to the pool.
+         * 
+         * @param batch The batch to recycle.
+         */
+        void operator()(Batch * batch) const;
+
+    private:
+        /**
+         * The pool the batch belongs to.
+         */
+        std::weak_ptr<BatchPool> pool;
+    };
+
+    /**
+     * A batch that returns to its pool when it is released.
+     */
+    typedef std::unique_ptr<Batch, BatchRecycler> BatchPtr;
+
+    /**
+     * A pool of preallocated batches. Batches are allocated on demand and 
+     * reused once they are released, so in the steady state no memory is 
+     * allocated. The pool must be owned by a std::shared_ptr.
+     */
+    class BatchPool : public std::enable_shared_from_this<BatchPool> {
+    public:
+        /**
+         * Initializes a new instance of the BatchPool class.
+         * 
+         * @param _format The format of the batches in the pool.
+         */
+        explicit BatchPool(const BatchFormat & _format) :
+        format(_format),
+        numAllocated(0) {}
+
+        /**
+         * Returns a batch from the pool. The content of the batch is 
+         * undefined.
+         * 
+         * @return A batch that returns to the pool when it is released.
+         */
+        BatchPtr acquire();
+
+        /**
+         * Returns a batch to the pool.
+         * 
+         * @param batch The batch to recycle.
+         */
+        void release(std::unique_ptr<Batch> batch);
+
+        /**
+         * Returns the total number of batches allocated by the pool.
+         * 
+         * @return The number of allocated batches.
+         */
+        int getNumAllocated() const;
+
+    private:
+        /**
+         * The format of the batches in the pool.
+         */
+        BatchFormat format;
+        /**
+         * The batches that are not in use.
+         */
+        std::vector<std::unique_ptr<Batch>> freeBatches;
+        /**
+         * The total number of batches allocated by the pool.
+         */
+        int numAllocated;
+        /**
+         * Guards the free list.
+         */
+        mutable std::mutex accessMutex;
+    };
+
+} // namespace chianti
+
+#endif
@@ -10,21 +10,71 @@
 #define CHIANTI_PROVIDERS_H
 
 #include <array>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <vector>
 
 #include <opencv2/opencv.hpp>
 
 #include "augmentors.h"
 #include "iterators.h"
 #include "loaders.h"
+#include "pool.h"
+#include "stats.h"
 #include "types.h"
 
 namespace chianti {
     /**
-     * A threaded data provider that loads images from disk asynchronously.
+     * Metrics of the batch queues that show whether training is bound by 
+     * the input pipeline.
+     */
+    struct QueueMetrics {
+        /**
+         * The number of calls to DataProvider::next().
+         */
+        uint64_t numCalls;
+        /**
+         * The total time in seconds the consumers were blocked in next().
+         */
+        double stallSeconds;
+        /**
+         * The total time in seconds the workers waited for room in the 
+         * queues, summed over all workers.
+         */
+        double producerWaitSeconds;
+        /**
+         * Histogram of the queue occupancy. Entry k counts the calls to 
+         * next() that found k completed batches in the consumer's queue.
+         */
+        std::vector<uint64_t> occupancy;
+        /**
+         * The number of samples that were skipped because they did not fill
+         * a whole batch, either at the end of an epoch or in a bucket that 
+         * was closed early. Always zero with partial batches.
+         */
+        uint64_t numDroppedSamples;
+    };
+
+    /**
+     * A threaded data provider that loads images from disk asynchronously. A
+     * pool of worker threads claims individual slots of the batches in the 
+     * queue, so the workers start on the next batch while the slowest samples
+     * of the current batch are still being processed.
+     * 
+     * A single provider can feed several consumers, e.g. data-parallel 
+     * training replicas. Batches are dealt to the consumers in round-robin 
+     * order, so consumer k receives batches k, k + K, k + 2K, ... through its
+     * own queue, while the decoding and augmentation work is shared.
+     * 
+     * By default, all samples must be of the size of the first sample. In 
+     * bucketing mode, samples are grouped by the size of their image and 
+     * target instead, and a batch is emitted as soon as its bucket is full.
      */
     class DataProvider {
     public:
@@ -46,6 +96,40 @@ namespace chianti {
         iterator(_iterator),
         batchSize(_batchSize), 
         numClasses(_numClasses), 
+        layout(Layout::NCHW),
+        imageFormat(ImageFormat::Float32),
+        targetFormat(TargetFormat::OneHot),
+        prefetchDepth(1),
+        numWorkers(defaultNumWorkers()),
+        autotune(false),
+        minWorkers(1),
+        minPrefetchDepth(1),
+        maxPrefetchDepth(1),
+        activeWorkers(0),
+        windowBatches(0),
+        windowConsumerWait(0),
+        windowProducerWait(0),
+        droppedSamples(0),
+        numConsumers(1),
+        nextConsumer(0),
+        partialBatches(false),
+        bucketing(false),
+        maxOpenBuckets(8),
+        reducedDecoding(true),
+        decodeReduction(1),
+        generation(0),
+        deterministic(false),
+        seed(0),
+        sampleCounter(0),
+        stats(std::make_shared<Stats>()),
+        iteratorStage(nullptr),
+        augmentStage(nullptr),
+        encodeStage(nullptr),
+        collateStage(nullptr),
+        slotWaitStage(nullptr),
+        storageWaitStage(nullptr),
+        batchWaitStage(nullptr),
+        initialized(false),
         terminateThread(false) {
         }
         
@@ -55,55 +139,532 @@ namespace chianti {
         ~DataProvider();
         
         /**
-         * Returns the next batch of images.
+         * Returns the next batch of images. The batch is returned to the 
+         * provider's pool and reused as soon as the handle is released.
+         * 
+         * Batches never span two epochs. The workers continue with the next 
+         * epoch without waiting for the consumer, and every batch is tagged 
+         * with the epoch it belongs to.
          * 
          * @return The next batch of images.
          */
-        std::unique_ptr<Batch> next();
+        BatchPtr next() {
+            return next(0);
+        }
         
         /**
-         * Initializes the provider.
+         * Returns the next batch of images for the given consumer. 
+         * 
+         * @param consumer The index of the consumer.
+         * @return The next batch of images.
+         */
+        BatchPtr next(int consumer);
+        
+        /**
+         * Initializes the provider. Throws if the iterator is empty.
          */
         void init();
         
         /**
-         * Resets the provider.
+         * Sets the memory layout of the images and one-hot targets. Must be 
+         * called before init().
+         * 
+         * @param _layout The memory layout.
+         */
+        void setLayout(Layout _layout);
+        
+        /**
+         * Returns the memory layout of the images and one-hot targets.
+         * 
+         * @return The memory layout.
+         */
+        Layout getLayout() const {
+            return layout;
+        }
+        
+        /**
+         * Sets the element type of the images. Float32 images are stored in 
+         * Batch::images, float16 images in Batch::halfImages and uint8 images
+         * in Batch::byteImages. Must be called before init().
+         * 
+         * @param format The image element type.
+         */
+        void setImageFormat(ImageFormat format);
+        
+        /**
+         * Returns the element type of the images.
+         * 
+         * @return The image element type.
+         */
+        ImageFormat getImageFormat() const {
+            return imageFormat;
+        }
+        
+        /**
+         * Sets the encoding of the targets. One-hot targets are stored in 
+         * Batch::targets, label maps in Batch::labels (uint8) or 
+         * Batch::wideLabels (int32). Must be called before init().
+         * 
+         * @param format The target encoding.
+         */
+        void setTargetFormat(TargetFormat format);
+        
+        /**
+         * Returns the encoding of the targets.
+         * 
+         * @return The target encoding.
          */
-        void reset() {
-            iterator->reset();
+        TargetFormat getTargetFormat() const {
+            return targetFormat;
         }
         
         /**
-         * Returns the number of batches.
+         * Sets the maximum number of batches that are prepared ahead of each
+         * consumer. Must be called before init().
+         * 
+         * @param depth The number of prefetched batches (at least 1).
+         */
+        void setPrefetchDepth(int depth);
+        
+        /**
+         * Returns the maximum number of prefetched batches. It may change at
+         * runtime if auto-tuning is enabled.
+         * 
+         * @return The prefetch depth.
+         */
+        int getPrefetchDepth() const;
+        
+        /**
+         * Sets the number of worker threads that load samples. Must be called
+         * before init().
+         * 
+         * @param workers The number of worker threads (at least 1).
+         */
+        void setNumWorkers(int workers);
+        
+        /**
+         * Returns the number of worker threads.
          * 
-         * @return The number of batches.
+         * @return The number of worker threads.
          */
-        int getNumBatches() const {
-            return iterator->getNumElements() / batchSize;
+        int getNumWorkers() const {
+            return numWorkers;
         }
         
+        /**
+         * Enables auto-tuning. The provider starts with the minimum number of
+         * workers and the minimum prefetch depth. Whenever the consumers had 
+         * to wait for batches, more workers are activated and, once all 
+         * workers are active, the prefetch depth is increased. If the workers
+         * mostly wait for room in the queues, workers are deactivated so their
+         * cores are left to the consumer. Must be called before init().
+         * 
+         * @param _minWorkers The minimum number of active workers.
+         * @param _maxWorkers The maximum number of active workers.
+         * @param minDepth The minimum prefetch depth.
+         * @param maxDepth The maximum prefetch depth.
+         */
+        void enableAutotune(int _minWorkers, int _maxWorkers, 
+                            int minDepth, int maxDepth);
+        
+        /**
+         * Returns true if auto-tuning is enabled.
+         * 
+         * @return Whether the worker count and depth are tuned at runtime.
+         */
+        bool isAutotuning() const {
+            return autotune;
+        }
+        
+        /**
+         * Returns the number of workers that currently load samples.
+         * 
+         * @return The number of active workers.
+         */
+        int getNumActiveWorkers() const;
+        
+        /**
+         * Sets the number of consumers. Must be called before init().
+         * 
+         * @param consumers The number of consumers (at least 1).
+         */
+        void setNumConsumers(int consumers);
+        
+        /**
+         * Returns the number of consumers.
+         * 
+         * @return The number of consumers.
+         */
+        int getNumConsumers() const {
+            return numConsumers;
+        }
+        
+        /**
+         * Enables the bucketing mode. Samples of different sizes are grouped 
+         * into batches of equal size, so mixed-resolution datasets do not 
+         * need to be resized to a common shape. Batches are emitted in the 
+         * order in which they fill up, which depends on the load times even 
+         * in deterministic mode. The number of distinct sizes should be 
+         * small, since each of them keeps a batch open. Without partial 
+         * batches, the samples left in unfilled buckets are dropped, which 
+         * can be a large share of the epoch if there are many sizes. They 
+         * are counted in the queue metrics. Must be called before init().
+         * 
+         * @see setMaxOpenBuckets()
+         * @param _bucketing Whether samples are grouped by size.
+         */
+        void setBucketing(bool _bucketing);
+        
+        /**
+         * Sets the maximum number of buckets that are open at the same time
+         * in bucketing mode, which bounds the memory held by unfilled 
+         * batches. A sample that would open another bucket first closes the
+         * fullest one. The closed bucket is emitted as a partial batch if 
+         * partial batches are allowed and its samples are dropped otherwise.
+         * The default is 8. Must be called before init().
+         * 
+         * @param buckets The maximum number of open buckets (at least 1).
+         */
+        void setMaxOpenBuckets(int buckets);
+        
+        /**
+         * Returns true if samples are grouped by size.
+         * 
+         * @return Whether the bucketing mode is enabled.
+         */
+        bool isBucketing() const {
+            return bucketing;
+        }
+        
+        /**
+         * Sets whether JPEG images are decoded at a reduced scale when the 
+         * augmentor starts by subsampling them by a factor of 2, 4 or 8. 
+         * This is enabled by default and reduces the decoding cost by about 
+         * the square of the factor. The decoder averages the pixels instead 
+         * of using a Lanczos filter, so the images differ slightly from 
+         * those subsampled after decoding. Must be called before init().
+         * 
+         * @param enabled Whether reduced decoding is used.
+         */
+        void setReducedDecoding(bool enabled);
+        
+        /**
+         * Sets whether the last batch of an epoch may be smaller than the 
+         * batch size. If false, the samples that do not fill a whole batch 
+         * are skipped. In bucketing mode, this applies to the last batch of 
+         * each bucket. Must be called before init().
+         * 
+         * @param partial Whether partial batches are returned.
+         */
+        void setPartialBatches(bool partial);
+        
+        /**
+         * Returns true if the last batch of an epoch may be partial.
+         * 
+         * @return Whether partial batches are returned.
+         */
+        bool getPartialBatches() const {
+            return partialBatches;
+        }
+        
+        /**
+         * Enables the deterministic mode. The random stream of each sample's
+         * augmentation is derived from the seed, the epoch and the position of
+         * the sample within the epoch. Together with a seeded iterator, the
+         * batches are bit-identical regardless of the number of workers. Must 
+         * be called before init().
+         * 
+         * @param _seed The global random seed.
+         */
+        void setSeed(unsigned int _seed);
+        
+        /**
+         * Returns true if the deterministic mode is enabled.
+         * 
+         * @return Whether the batches are reproducible.
+         */
+        bool isDeterministic() const {
+            return deterministic;
+        }
+        
+        /**
+         * Returns the timing counters of the pipeline stages: "load.image" 
+         * and "load.target" (reading and decoding, including the mapping of
+         * target values), "augment" (all augmentations) with one sub-stage 
+         * per step of a CombinedAugmentor, "encode" (writing the targets to 
+         * the batch) and "collate" (converting the image to the batch 
+         * layout and precision, including the replacement of NaN values).
+         * 
+         * In addition, "iterator.next" counts the time spent advancing the 
+         * iterator, "wait.slot" the time workers wait for room in the 
+         * queues, "wait.storage" the time workers wait for the storage of a 
+         * batch and "wait.batch" the time the consumers wait for a batch.
+         * A CachingImageTargetPairLoader reports its hits as "load.cache" and
+         * a ShardCacheLoader reports its hits as "load.shard". Loaders that
+         * read from a byte source report the reading as "load.read".
+         * 
+         * @return The counters of each stage.
+         */
+        std::vector<StageSummary> getStats() const {
+            return stats->summarize();
+        }
+        
+        /**
+         * Returns the consumer stall time, the producer wait time, the 
+         * queue occupancy histogram and the number of dropped samples. A job whose consumers stall while the
+         * queues are mostly empty is bound by the input pipeline; one whose
+         * workers wait for room in full queues is not.
+         * 
+         * @return The metrics since the last call to clearStats().
+         */
+        QueueMetrics getQueueMetrics() const;
+        
+        /**
+         * Sets all timing counters and queue metrics to zero.
+         */
+        void clearStats();
+        
+        /**
+         * Starts recording every execution of a stage as a span with its 
+         * thread, its start and end time and the image filename of the 
+         * sample. Spans recorded earlier are discarded.
+         */
+        void startTracing() {
+            stats->getTracer().start();
+        }
+        
+        /**
+         * Stops recording spans.
+         */
+        void stopTracing() {
+            stats->getTracer().stop();
+        }
+        
+        /**
+         * Saves the recorded spans in the Chrome trace event format. The file
+         * can be opened in chrome://tracing or ui.perfetto.dev.
+         * 
+         * @param filename The name of the JSON file.
+         */
+        void saveTrace(const std::string & filename) const {
+            stats->getTracer().save(filename);
+        }
+        
+        /**
+         * Resets the provider. Prefetched and in-flight batches are discarded
+         * and the next batch starts at the beginning of epoch 0. Consecutive 
+         * epochs do not require a reset.
+         */
+        void reset();
+        
+        /**
+         * Returns the number of batches per epoch.
+         * 
+         * @return The number of batches per epoch or -1 in bucketing mode.
+         */
+        int getNumBatches() const;
+        
     private:
         /**
-         * Loads the next batch.
+         * A batch that is either in construction or ready to be consumed.
          */
-        void loadBatch();
+        struct PendingBatch {
+            PendingBatch(int _size, int _epoch) : 
+            size(_size), epoch(_epoch), claimed(0), completed(0) {}
+            
+            /**
+             * The batch storage. It is allocated by the worker that opened the
+             * batch after the lock has been released, so it may still be null
+             * while other workers have already claimed slots.
+             */
+            BatchPtr batch;
+            /**
+             * The number of samples in the batch.
+             */
+            int size;
+            /**
+             * The epoch the samples belong to.
+             */
+            int epoch;
+            /**
+             * The number of slots that have been handed out to workers.
+             */
+            int claimed;
+            /**
+             * The number of slots that have been written.
+             */
+            int completed;
+            /**
+             * The first error that occurred while filling the batch.
+             */
+            std::exception_ptr error;
+        };
+        
+        /**
+         * The main loop of the worker threads.
+         * 
+         * @param index The index of the worker.
+         */
+        void work(int index);
+        
+        /**
+         * The main loop of the worker threads in bucketing mode.
+         * 
+         * @param index The index of the worker.
+         */
+        void workBucketed(int index);
+        
+        /**
+         * Waits until the worker may claim a sample. The time spent waiting 
+         * for room in the queues is recorded for auto-tuning.
+         * 
+         * @param lock The lock on batchAccessMutex.
+         * @param index The index of the worker.
+         * @return False if the worker shall terminate.
+         */
+        bool waitForSlot(std::unique_lock<std::mutex> & lock, int index);
+        
+        /**
+         * Adjusts the number of active workers and the prefetch depth after a
+         * batch has been handed out. Must be called while holding 
+         * batchAccessMutex.
+         * 
+         * @param consumerWait The time in seconds the consumer waited for the
+         *                     batch.
+         */
+        void tune(double consumerWait);
+        
+        /**
+         * Returns true if a worker can claim a slot. Must be called while 
+         * holding batchAccessMutex.
+         */
+        bool hasOpenSlot() const;
+        
+        /**
+         * Opens a new batch at the current position of the iterator and 
+         * appends it to the queue of the next consumer. Must be called while
+         * holding batchAccessMutex.
+         */
+        void openNextBatch();
+        
+        /**
+         * Appends a batch to the queue of the next consumer. Must be called 
+         * while holding batchAccessMutex.
+         */
+        void enqueue(std::shared_ptr<PendingBatch> pending);
+        
+        /**
+         * Emits or discards the open buckets of an epoch once all of its 
+         * samples have been placed. Must be called while holding 
+         * batchAccessMutex.
+         * 
+         * @param epoch The epoch to flush.
+         * @return True if a batch has been added to a queue.
+         */
+        bool flushEpoch(int epoch);
+        
+        /**
+         * Emits the open batch of a bucket as a partial batch if partial 
+         * batches are allowed and discards it otherwise. The bucket is 
+         * removed. Must be called while holding batchAccessMutex.
+         * 
+         * @param bucket The bucket.
+         * @return True if a batch has been added to a queue.
+         */
+        bool closeBucket(std::map<std::array<int, 5>, 
+                std::shared_ptr<PendingBatch>>::iterator bucket);
+        
+        /**
+         * Allocates the storage of a batch and wakes up the workers that wait
+         * for it.
+         * 
+         * @param pending The batch.
+         * @param pool The pool to take the storage from.
+         */
+        void provideStorage(PendingBatch & pending, BatchPool & pool);
+        
+        /**
+         * Waits until the storage of a batch has been allocated.
+         * 
+         * @param pending The batch.
+         * @return The storage of the batch.
+         */
+        Batch & waitForStorage(PendingBatch & pending);
+        
+        /**
+         * Marks a slot of the batch as written.
+         * 
+         * @param pending The batch.
+         * @param error The error that occurred while filling the slot, if any.
+         */
+        void finishSlot(PendingBatch & pending, std::exception_ptr error);
+        
+        /**
+         * Returns the pool for batches of the given size. Must be called while
+         * holding batchAccessMutex.
+         */
+        std::shared_ptr<BatchPool> getPool(
+                const std::array<int, 2> & _imageSize,
+                const std::array<int, 2> & _targetSize);
+        
+        /**
+         * Returns the format of batches of the given size.
+         */
+        BatchFormat makeFormat(
+                const std::array<int, 2> & _imageSize,
+                const std::array<int, 2> & _targetSize) const;
+        
+        /**
+         * Loads a single sample and writes it to the given slot of the batch.
+         * 
+         * @param filenames The sample to load.
+         * @param sample The number of samples that preceded this one.
+         * @param batch The batch to write to.
+         * @param slot The index of the sample within the batch.
+         */
+        void fillSlot(IteratorInterface::ElementIterator filenames, 
+                      size_t sample,
+                      Batch & batch, 
+                      int slot);
+        
+        /**
+         * Writes a loaded sample to the given slot of the batch. The sample
+         * must be of the size of the batch.
+         * 
+         * @param pair The sample.
+         * @param batch The batch to write to.
+         * @param slot The index of the sample within the batch.
+         */
+        void storeSample(const ImageTargetPair & pair, 
+                         Batch & batch, 
+                         int slot);
+        
+        /**
+         * Returns the default number of worker threads.
+         */
+        static int defaultNumWorkers();
         
         /**
          * Loads a single image.
          * 
+         * @param filenames The sample to load.
+         * @param sample The number of samples that preceded this one. It 
+         *               determines the random stream in deterministic mode.
          * @return Image target pair
          */
-        ImageTargetPair load(IteratorInterface::ElementIterator filenames);
+        ImageTargetPair load(IteratorInterface::ElementIterator filenames,
+                             size_t sample);
         
         /**
-         * Fills the target tensor with one-hot encoded values.
+         * Fills the target tensor with one-hot encoded values in the 
+         * provider's layout.
          * 
          * @param img
          * @param size
          */
         void encode_onehot(const cv::Mat & targetImg, 
                            Tensor<float, 4> & targetTensor, 
-                           int offset);
+                           std::size_t offset);
         
         /**
          * Throws a runtime exception if image is not of the given size.
@@ -116,6 +677,11 @@ namespace chianti {
          */
         static void assertType(const cv::Mat & img, int type);
         
+        /**
+         * Throws a runtime exception if the provider has been initialized.
+         */
+        void assertNotInitialized() const;
+        
         /**
          * Data augmentor.
          */
@@ -145,25 +711,205 @@ namespace chianti {
          */
         int numClasses;
         /**
-         * The next batch of images.
+         * The memory layout of the images and one-hot targets.
+         */
+        Layout layout;
+        /**
+         * The element type of the images.
+         */
+        ImageFormat imageFormat;
+        /**
+         * The encoding of the targets.
+         */
+        TargetFormat targetFormat;
+        /**
+         * The maximum number of completed batches in each consumer's queue. 
+         * One more batch may be in construction.
+         */
+        int prefetchDepth;
+        /**
+         * The number of worker threads.
+         */
+        int numWorkers;
+        /**
+         * Whether the number of active workers and the prefetch depth are 
+         * tuned at runtime.
+         */
+        bool autotune;
+        /**
+         * The minimum number of active workers.
+         */
+        int minWorkers;
+        /**
+         * The minimum prefetch depth.
+         */
+        int minPrefetchDepth;
+        /**
+         * The maximum prefetch depth.
+         */
+        int maxPrefetchDepth;
+        /**
+         * The number of workers that may claim samples. The workers with a 
+         * higher index are parked.
+         */
+        int activeWorkers;
+        /**
+         * The number of batches handed out in the current tuning window.
+         */
+        int windowBatches;
+        /**
+         * The start of the current tuning window.
+         */
+        std::chrono::steady_clock::time_point windowStart;
+        /**
+         * The time in seconds the consumers waited for batches in the current
+         * tuning window.
+         */
+        double windowConsumerWait;
+        /**
+         * The time in seconds the active workers waited for room in the 
+         * queues in the current tuning window.
+         */
+        double windowProducerWait;
+        /**
+         * The number of completed batches next() found in the queue of the 
+         * consumer, as a histogram. Guarded by batchAccessMutex.
+         */
+        std::vector<uint64_t> occupancy;
+        /**
+         * The number of samples that have been dropped because they did not 
+         * fill a whole batch. Guarded by batchAccessMutex.
+         */
+        uint64_t droppedSamples;
+        /**
+         * The number of consumers.
+         */
+        int numConsumers;
+        /**
+         * The consumer that receives the next batch that is opened.
+         */
+        int nextConsumer;
+        /**
+         * Whether the last batch of an epoch may be partial.
+         */
+        bool partialBatches;
+        /**
+         * Whether samples are grouped by size.
+         */
+        bool bucketing;
+        /**
+         * The maximum number of open buckets in bucketing mode.
+         */
+        int maxOpenBuckets;
+        /**
+         * Whether JPEG images may be decoded at a reduced scale.
+         */
+        bool reducedDecoding;
+        /**
+         * The factor by which images are downscaled while decoding them.
+         */
+        int decodeReduction;
+        /**
+         * The number of resets. Samples that have been claimed before a reset
+         * are dropped in bucketing mode.
+         */
+        int generation;
+        /**
+         * Whether the augmentations are derived from the seed.
+         */
+        bool deterministic;
+        /**
+         * The global random seed used in deterministic mode.
+         */
+        unsigned int seed;
+        /**
+         * The number of samples that have been claimed since the last reset.
+         * Guarded by batchAccessMutex.
+         */
+        size_t sampleCounter;
+        /**
+         * The timing counters of the pipeline stages.
+         */
+        std::shared_ptr<Stats> stats;
+        /**
+         * The stage of the iterator.
+         */
+        StageStats * iteratorStage;
+        /**
+         * The stage of the augmentor or null if there is none.
+         */
+        StageStats * augmentStage;
+        /**
+         * The stage of the target encoding.
+         */
+        StageStats * encodeStage;
+        /**
+         * The stage of the image conversion.
+         */
+        StageStats * collateStage;
+        /**
+         * The stage of the workers waiting for room in the queues.
+         */
+        StageStats * slotWaitStage;
+        /**
+         * The stage of the workers waiting for the storage of a batch.
+         */
+        StageStats * storageWaitStage;
+        /**
+         * The stage of the consumers waiting for a batch.
+         */
+        StageStats * batchWaitStage;
+        /**
+         * Whether init() has been called.
+         */
+        bool initialized;
+        /**
+         * The pools of batches that are recycled once the consumer releases 
+         * them, keyed by the image and target size.
+         */
+        std::map<std::array<int, 4>, std::shared_ptr<BatchPool>> pools;
+        /**
+         * The queues of the consumers. Each queue holds the batches in the 
+         * order in which they are handed out. Batches at the back may still
+         * be in construction.
+         */
+        std::vector<std::deque<std::shared_ptr<PendingBatch>>> queues;
+        /**
+         * The batch in which workers currently claim slots.
+         */
+        std::shared_ptr<PendingBatch> openBatch;
+        /**
+         * The open batches in bucketing mode, keyed by the epoch, the image 
+         * size and the target size.
+         */
+        std::map<std::array<int, 5>, std::shared_ptr<PendingBatch>> buckets;
+        /**
+         * The number of samples per epoch that have been placed in a bucket.
+         */
+        std::map<int, size_t> placedSamples;
+        /**
+         * Batch access mutex. It guards the queue and the slot counters, but
+         * not the loading of the samples.
          */
-        std::unique_ptr<Batch> batch;
+        mutable std::mutex batchAccessMutex;
         /**
-         * Batch access mutex
+         * Conditional variable for waiting for the next batch of any consumer
+         * to be computed.
          */
-        std::mutex batchAccessMutex;
+        std::condition_variable batchAvailable;
         /**
-         * Conditional variable for waiting for the next batch to be computed.
+         * Conditional variable for waiting for a free slot in the queue or for
+         * the storage of a batch to be allocated.
          */
-        std::condition_variable cv;
+        std::condition_variable slotAvailable;
         /**
-         * Whether the prefill thread shall be terminated.
+         * Whether the worker threads shall be terminated.
          */
         bool terminateThread;
         /**
-         * The prefill thread.
+         * The worker threads.
          */
-        std::thread prefillThread;
+        std::vector<std::thread> workers;
         
     };
     
@@ -0,0 +1,167 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+#ifndef CHIANTI_RANDOM_H
+#define CHIANTI_RANDOM_H
+
+#include <array>
+#include <cstdint>
+#include <limits>
+
+namespace chianti {
+
+    /**
+     * A counter-based random number engine (Philox4x32-10, Salmon et al.,
+     * "Parallel Random Numbers: As Easy as 1, 2, 3", SC 2011). The output is a
+     * bijection of a 128 bit counter under a 64 bit key. Every (key, stream)
+     * pair therefore yields an independent sequence, and creating an engine
+     * is as cheap as copying six integers. This allows each sample to have
+     * its own engine without any shared state.
+     *
+     * The class satisfies the UniformRandomBitGenerator requirements, so it
+     * can be used with the distributions of <random>.
+     */
+    class Philox4x32 {
+    public:
+        typedef uint32_t result_type;
+
+        /**
+         * Initializes a new instance of the Philox4x32 class.
+         *
+         * @param _key The key, e.g. a random seed.
+         * @param _stream The index of the stream under the given key.
+         */
+        explicit Philox4x32(uint64_t _key = 0, uint64_t _stream = 0) :
+        key({{static_cast<uint32_t>(_key), 
+              static_cast<uint32_t>(_key >> 32)}}),
+        counter({{0, 0,
+                  static_cast<uint32_t>(_stream),
+                  static_cast<uint32_t>(_stream >> 32)}}),
+        output(),
+        index(4) {
+        }
+
+        /**
+         * Returns the smallest value the engine generates.
+         */
+        static constexpr result_type min() {
+            return 0;
+        }
+
+        /**
+         * Returns the largest value the engine generates.
+         */
+        static constexpr result_type max() {
+            return std::numeric_limits<result_type>::max();
+        }
+
+        /**
+         * Returns the next random number.
+         *
+         * @return A uniformly distributed 32 bit integer.
+         */
+        result_type operator()() {
+            if (index == 4) {
+                generate();
+                index = 0;
+            }
+            return output[index++];
+        }
+
+        /**
+         * Creates an engine for a sub-stream. The result only depends on the
+         * key, the stream of this engine and the given index, but not on the
+         * numbers that have been drawn so far.
+         *
+         * @param substream The index of the sub-stream.
+         * @return The engine for the sub-stream.
+         */
+        Philox4x32 split(uint32_t substream) const {
+            // Derive the new key from the current key and stream, so sub-
+            // streams of different streams do not overlap
+            Philox4x32 derived(*this);
+            derived.counter[0] = substream;
+            derived.counter[1] = 0xffffffff;
+            derived.generate();
+
+            Philox4x32 result;
+            result.key = {{derived.output[0], derived.output[1]}};
+            result.counter = {{0, 0, derived.output[2], derived.output[3]}};
+            return result;
+        }
+
+    private:
+        /**
+         * Computes the next block of four random numbers and increments the
+         * counter.
+         */
+        void generate() {
+            std::array<uint32_t, 4> x = counter;
+            std::array<uint32_t, 2> k = key;
+            for (int round = 0; round < 10; round++) {
+                const uint64_t p0 = static_cast<uint64_t>(0xD2511F53) * x[0];
+                const uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57) * x[2];
+                x = {{static_cast<uint32_t>(p1 >> 32) ^ x[1] ^ k[0],
+                      static_cast<uint32_t>(p1),
+                      static_cast<uint32_t>(p0 >> 32) ^ x[3] ^ k[1],
+                      static_cast<uint32_t>(p0)}};
+                k[0] += 0x9E3779B9;
+                k[1] += 0xBB67AE85;
+            }
+            output = x;
+
+            // The lower 64 bits of the counter enumerate the blocks
+            if (++counter[0] == 0) {
+                ++counter[1];
+            }
+        }
+
+        /**
+         * The key.
+         */
+        std::array<uint32_t, 2> key;
+        /**
+         * The counter of the next block. The upper 64 bits hold the stream.
+         */
+        std::array<uint32_t, 4> counter;
+        /**
+         * The current block of random numbers.
+         */
+        std::array<uint32_t, 4> output;
+        /**
+         * The index of the next number in the current block.
+         */
+        int index;
+    };
+
+    /**
+     * The random number engine augmentors draw from.
+     */
+    typedef Philox4x32 RandomEngine;
+
+    /**
+     * Creates the random engine for a single sample. The state of the engine
+     * only depends on the arguments, so the same sample is augmented in the
+     * same way regardless of which thread processes it.
+     *
+     * @param seed The global seed.
+     * @param epoch The epoch the sample belongs to.
+     * @param position The position of the sample within the epoch.
+     * @return The random engine for the sample.
+     */
+    inline RandomEngine makeSampleEngine(
+            unsigned int seed,
+            unsigned int epoch,
+            unsigned int position) {
+        return RandomEngine(
+                seed, static_cast<uint64_t>(epoch) << 32 | position);
+    }
+
+} // namespace chianti
+
+#endif
@@ -0,0 +1,262 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+#ifndef CHIANTI_SHARDS_H
+#define CHIANTI_SHARDS_H
+
+#include <opencv2/opencv.hpp>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "augmentors.h"
+#include "loaders.h"
+#include "types.h"
+
+namespace chianti {
+
+    /**
+     * A persistent cache of preprocessed image/target pairs on disk. The
+     * pairs are stored as raw pixel data in large shard files, which are
+     * memory-mapped, so reading a pair is a copy from the page cache instead
+     * of a decode. An index file maps the filenames of each pair to its
+     * location.
+     *
+     * The index is written last and replaced atomically, so a cache is
+     * either complete or absent. Several processes can read the same cache.
+     * The files use the byte order of the machine that built them.
+     */
+    class ShardCache {
+    public:
+        /**
+         * Opens an existing cache.
+         *
+         * @param directory The directory of the cache.
+         */
+        explicit ShardCache(const std::string & directory);
+
+        /**
+         * Unmaps the shards.
+         */
+        ~ShardCache();
+
+        /**
+         * Returns true if the directory contains a complete cache.
+         *
+         * @param directory The directory of the cache.
+         * @return Whether the cache exists.
+         */
+        static bool exists(const std::string & directory);
+
+        /**
+         * Loads and preprocesses all pairs in parallel and writes them to a
+         * new cache. An existing cache in the directory is replaced and its
+         * shards are deleted.
+         *
+         * @param directory The directory of the cache. It is created if it
+         *                  does not exist.
+         * @param loader The loader.
+         * @param preprocessor The deterministic augmentor that is applied
+         *                     after loading or null.
+         * @param files The pairs to store.
+         * @param numThreads The number of threads that load the pairs.
+         * @param shardSize The size in bytes after which a new shard is
+         *                  started.
+         * @return The new cache.
+         */
+        static std::shared_ptr<ShardCache> build(
+                const std::string & directory,
+                const ImageTargetPairLoader & loader,
+                std::shared_ptr<AugmentorInterface> preprocessor,
+                std::vector<FilenamePair> files,
+                int numThreads,
+                size_t shardSize = 1 << 30);
+
+        /**
+         * Opens the cache in the given directory or builds it if it does not
+         * exist yet. The cache is rebuilt if it was built from other pairs 
+         * or with loaders or a preprocessor of a different description, and
+         * if its index is corrupt.
+         *
+         * @see build()
+         */
+        static std::shared_ptr<ShardCache> openOrBuild(
+                const std::string & directory,
+                const ImageTargetPairLoader & loader,
+                std::shared_ptr<AugmentorInterface> preprocessor,
+                std::vector<FilenamePair> files,
+                int numThreads,
+                size_t shardSize = 1 << 30);
+
+        /**
+         * Looks up a pair and copies it out of the shard.
+         *
+         * @param filenames The filenames of the pair.
+         * @param pair The pair. Only written if the pair is in the cache.
+         * @return True if the pair is in the cache.
+         */
+        bool find(const FilenamePair & filenames, ImageTargetPair & pair) const;
+
+        /**
+         * Returns the number of pairs in the cache.
+         *
+         * @return The number of pairs.
+         */
+        size_t getNumPairs() const {
+            return entries.size();
+        }
+
+        /**
+         * Returns the description of the loaders the cache was built with.
+         *
+         * @return The description.
+         */
+        const std::string & getLoader() const {
+            return loader;
+        }
+
+        /**
+         * Returns the description of the preprocessor the cache was built 
+         * with.
+         *
+         * @return The description or an empty string if there was none.
+         */
+        const std::string & getPreprocessor() const {
+            return preprocessor;
+        }
+
+    private:
+        ShardCache(const ShardCache &);
+        ShardCache & operator=(const ShardCache &);
+
+        /**
+         * The location and shape of a stored pair.
+         */
+        struct Entry {
+            /**
+             * The index of the shard.
+             */
+            uint32_t shard;
+            /**
+             * The offset of the image in the shard. The target follows the
+             * image.
+             */
+            uint64_t offset;
+            /**
+             * The rows, columns and OpenCV type of the image.
+             */
+            int32_t image[3];
+            /**
+             * The rows, columns and OpenCV type of the target.
+             */
+            int32_t target[3];
+        };
+
+        /**
+         * A memory-mapped shard.
+         */
+        struct Shard {
+            /**
+             * The first byte of the mapping.
+             */
+            const uchar * data;
+            /**
+             * The size of the mapping in bytes.
+             */
+            size_t size;
+        };
+
+        /**
+         * The description of the loaders.
+         */
+        std::string loader;
+        /**
+         * The description of the preprocessor.
+         */
+        std::string preprocessor;
+        /**
+         * The hash of the pairs the cache was built from.
+         */
+        uint64_t filesHash;
+        /**
+         * The shards.
+         */
+        std::vector<Shard> shards;
+        /**
+         * Maps the filenames of the pairs to their entries.
+         */
+        std::map<std::pair<std::string, std::string>, Entry> entries;
+    };
+
+    /**
+     * Serves image/target pairs from a shard cache. The cache holds the
+     * output of the deterministic prefix of the pipeline, i.e. the loaders
+     * and a preprocessor such as a SubsampleAugmentor. The random
+     * augmentations are left to the DataProvider. Pairs that are not in the
+     * cache are loaded and preprocessed as usual.
+     */
+    class ShardCacheLoader : public ImageTargetPairLoader {
+    public:
+        /**
+         * Initializes a new instance of the ShardCacheLoader class.
+         *
+         * @param _imageLoader The image loader.
+         * @param _targetLoader The target loader.
+         * @param _preprocessor The deterministic augmentor the cache was
+         *                      built with or null.
+         * @param _cache The cache. It must have been built with the same
+         *               loaders and preprocessor.
+         */
+        ShardCacheLoader(
+                std::shared_ptr<LoaderInterface> _imageLoader,
+                std::shared_ptr<LoaderInterface> _targetLoader,
+                std::shared_ptr<AugmentorInterface> _preprocessor,
+                std::shared_ptr<ShardCache> _cache);
+
+        /**
+         * Copies the pair from the cache or loads and preprocesses it.
+         *
+         * @param filenames The filenames to load.
+         * @param imageReduction Ignored. Cached pairs are already
+         *                       preprocessed.
+         * @return The preprocessed pair.
+         */
+        ImageTargetPair load(
+                IteratorInterface::ElementIterator filenames,
+                int imageReduction = 1) const;
+
+        /**
+         * Records the stages of the ImageTargetPairLoader and the time spent
+         * copying pairs out of the cache in the stage "load.shard".
+         *
+         * @param stats The statistics to record in.
+         */
+        void instrument(std::shared_ptr<Stats> stats);
+
+    private:
+        /**
+         * The deterministic augmentor or null.
+         */
+        std::shared_ptr<AugmentorInterface> preprocessor;
+        /**
+         * The cache.
+         */
+        std::shared_ptr<ShardCache> cache;
+        /**
+         * The stage of copying cached pairs or null.
+         */
+        StageStats * shardStage;
+    };
+
+} // namespace chianti
+
+#endif
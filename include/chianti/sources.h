@@ -0,0 +1,78 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+#ifndef CHIANTI_SOURCES_H
+#define CHIANTI_SOURCES_H
+
+#include <opencv2/opencv.hpp>
+
+#include <string>
+#include <vector>
+
+#include "types.h"
+
+namespace chianti {
+
+    /**
+     * Reads the encoded bytes of image/target pairs. Separating reading from
+     * decoding allows the bytes to come from files, archives or caches and 
+     * to be timed on their own. Sources must be safe to use from several 
+     * threads.
+     */
+    class ByteSourceInterface {
+    public:
+        /**
+         * Destructor.
+         */
+        virtual ~ByteSourceInterface() {}
+
+        /**
+         * Reads the encoded image and target of a pair and throws an error 
+         * if they cannot be read.
+         * 
+         * @param filenames The filenames of the pair.
+         * @param image The encoded image.
+         * @param target The encoded target.
+         */
+        virtual void read(
+                const FilenamePair & filenames,
+                std::vector<uchar> & image,
+                std::vector<uchar> & target) const = 0;
+    };
+
+    /**
+     * Reads the image and the target from individual files.
+     */
+    class FileByteSource : public ByteSourceInterface {
+    public:
+        /**
+         * Reads the image file and the target file.
+         * 
+         * @param filenames The filenames of the pair.
+         * @param image The contents of the image file.
+         * @param target The contents of the target file.
+         */
+        void read(
+                const FilenamePair & filenames,
+                std::vector<uchar> & image,
+                std::vector<uchar> & target) const;
+
+        /**
+         * Reads a whole file into memory.
+         * 
+         * @param filename The file to read.
+         * @param buffer The contents of the file.
+         */
+        static void readFile(
+                const std::string & filename, 
+                std::vector<uchar> & buffer);
+    };
+
+} // namespace chianti
+
+#endif
@@ -0,0 +1,217 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+#ifndef CHIANTI_STATS_H
+#define CHIANTI_STATS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "trace.h"
+
+namespace chianti {
+
+    /**
+     * A snapshot of the counters of a pipeline stage.
+     */
+    struct StageSummary {
+        /**
+         * The name of the stage.
+         */
+        std::string name;
+        /**
+         * The number of times the stage has been executed.
+         */
+        uint64_t count;
+        /**
+         * The total time spent in the stage in seconds.
+         */
+        double totalSeconds;
+        /**
+         * Histogram of the latencies. Bin 0 counts latencies below 1us, bin 
+         * k > 0 counts latencies in [2^(k-1)us, 2^k us).
+         */
+        std::vector<uint64_t> histogram;
+    };
+
+    /**
+     * Counters of a single pipeline stage. Recording is lock-free, so it can
+     * be done from all worker threads. While tracing is enabled, every 
+     * execution is additionally recorded as a span.
+     */
+    class StageStats {
+    public:
+        /**
+         * The number of histogram bins.
+         */
+        static const int kNumBins = 32;
+
+        /**
+         * Initializes a new instance of the StageStats class.
+         * 
+         * @param _name The name of the stage.
+         * @param _tracer The tracer to record spans in or null.
+         */
+        StageStats(const std::string & _name, Tracer * _tracer);
+
+        /**
+         * Records one execution of the stage.
+         * 
+         * @param duration The time the execution took.
+         */
+        void record(std::chrono::steady_clock::duration duration);
+
+        /**
+         * Records one execution of the stage and its span.
+         * 
+         * @param start The time the execution started.
+         * @param end The time the execution ended.
+         */
+        void record(
+                std::chrono::steady_clock::time_point start,
+                std::chrono::steady_clock::time_point end);
+
+        /**
+         * Returns a snapshot of the counters.
+         * 
+         * @return The snapshot.
+         */
+        StageSummary summarize() const;
+
+        /**
+         * Sets all counters to zero.
+         */
+        void clear();
+
+    private:
+        /**
+         * The name of the stage.
+         */
+        std::string name;
+        /**
+         * The tracer to record spans in or null.
+         */
+        Tracer * tracer;
+        /**
+         * The number of executions.
+         */
+        std::atomic<uint64_t> count;
+        /**
+         * The total time in nanoseconds.
+         */
+        std::atomic<uint64_t> totalNanoseconds;
+        /**
+         * The latency histogram.
+         */
+        std::array<std::atomic<uint64_t>, kNumBins> histogram;
+    };
+
+    /**
+     * A collection of named pipeline stages. Stages are registered once and
+     * then updated through the returned reference without locking.
+     */
+    class Stats {
+    public:
+        /**
+         * Returns the stage with the given name. It is created if it does not
+         * exist yet.
+         * 
+         * @param name The name of the stage.
+         * @return The counters of the stage. The reference is valid for the 
+         *         lifetime of this object.
+         */
+        StageStats & getStage(const std::string & name);
+
+        /**
+         * Returns a snapshot of all stages in the order of registration.
+         * 
+         * @return The snapshots.
+         */
+        std::vector<StageSummary> summarize() const;
+
+        /**
+         * Sets the counters of all stages to zero.
+         */
+        void clear();
+
+        /**
+         * Returns the tracer the stages record their spans in.
+         * 
+         * @return The tracer.
+         */
+        Tracer & getTracer() {
+            return tracer;
+        }
+
+    private:
+        /**
+         * The tracer shared by all stages.
+         */
+        Tracer tracer;
+        /**
+         * The registered stages.
+         */
+        std::vector<std::pair<std::string, std::unique_ptr<StageStats>>> 
+                stages;
+        /**
+         * Guards the list of stages.
+         */
+        mutable std::mutex accessMutex;
+    };
+
+    /**
+     * Records the lifetime of the object in a stage. If the stage is null, 
+     * nothing is measured.
+     */
+    class ScopedStageTimer {
+    public:
+        /**
+         * Initializes a new instance of the ScopedStageTimer class.
+         * 
+         * @param _stage The stage to record in.
+         */
+        explicit ScopedStageTimer(StageStats * _stage) : 
+        stage(_stage) {
+            if (stage != nullptr) {
+                start = std::chrono::steady_clock::now();
+            }
+        }
+
+        /**
+         * Records the elapsed time.
+         */
+        ~ScopedStageTimer() {
+            if (stage != nullptr) {
+                stage->record(start, std::chrono::steady_clock::now());
+            }
+        }
+
+    private:
+        ScopedStageTimer(const ScopedStageTimer &);
+        ScopedStageTimer & operator=(const ScopedStageTimer &);
+
+        /**
+         * The stage to record in.
+         */
+        StageStats * stage;
+        /**
+         * The time the object was created.
+         */
+        std::chrono::steady_clock::time_point start;
+    };
+
+} // namespace chianti
+
+#endif
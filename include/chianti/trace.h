@@ -0,0 +1,170 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+#ifndef CHIANTI_TRACE_H
+#define CHIANTI_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace chianti {
+
+    /**
+     * Records spans of the pipeline stages on a timeline. The spans can be
+     * saved in the Chrome trace event format and viewed in chrome://tracing
+     * or Perfetto. Tracing is disabled by default, in which case recording a
+     * span costs a single atomic load.
+     */
+    class Tracer {
+    public:
+        /**
+         * Initializes a new instance of the Tracer class.
+         */
+        Tracer();
+
+        /**
+         * Discards all recorded spans and starts recording.
+         */
+        void start();
+
+        /**
+         * Stops recording. The recorded spans are kept.
+         */
+        void stop();
+
+        /**
+         * Returns true if spans are recorded.
+         *
+         * @return True if tracing is enabled.
+         */
+        bool isEnabled() const {
+            return enabled.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * Records a span on the calling thread. The span is labeled with the
+         * sample the thread is currently working on (see ScopedTraceLabel).
+         * Does nothing if tracing is disabled.
+         *
+         * @param name The name of the stage.
+         * @param start The time the span started.
+         * @param end The time the span ended.
+         */
+        void record(
+                const std::string & name,
+                std::chrono::steady_clock::time_point start,
+                std::chrono::steady_clock::time_point end);
+
+        /**
+         * Writes the recorded spans as Chrome trace JSON.
+         *
+         * @param stream The stream to write to.
+         */
+        void write(std::ostream & stream) const;
+
+        /**
+         * Writes the recorded spans as Chrome trace JSON to a file.
+         *
+         * @param filename The name of the file.
+         */
+        void save(const std::string & filename) const;
+
+    private:
+        /**
+         * A recorded span.
+         */
+        struct Span {
+            /**
+             * The name of the stage.
+             */
+            std::string name;
+            /**
+             * The sample the span belongs to. May be empty.
+             */
+            std::string label;
+            /**
+             * The index of the thread that recorded the span.
+             */
+            int thread;
+            /**
+             * The start of the span.
+             */
+            std::chrono::steady_clock::time_point start;
+            /**
+             * The end of the span.
+             */
+            std::chrono::steady_clock::time_point end;
+        };
+
+        /**
+         * True if spans are recorded.
+         */
+        std::atomic<bool> enabled;
+        /**
+         * The time tracing was started. All timestamps are relative to it.
+         */
+        std::chrono::steady_clock::time_point origin;
+        /**
+         * The recorded spans.
+         */
+        std::vector<Span> spans;
+        /**
+         * Maps the threads to small consecutive indices.
+         */
+        std::map<std::thread::id, int> threads;
+        /**
+         * Guards the spans and the threads.
+         */
+        mutable std::mutex accessMutex;
+    };
+
+    /**
+     * Labels all spans the calling thread records during the lifetime of the
+     * object, e.g. with the filename of the sample being processed. Labels
+     * can be nested.
+     */
+    class ScopedTraceLabel {
+    public:
+        /**
+         * Initializes a new instance of the ScopedTraceLabel class.
+         *
+         * @param label The label. Must outlive this object.
+         */
+        explicit ScopedTraceLabel(const std::string & label);
+
+        /**
+         * Restores the previous label.
+         */
+        ~ScopedTraceLabel();
+
+        /**
+         * Returns the label of the calling thread or null.
+         *
+         * @return The current label.
+         */
+        static const std::string * current();
+
+    private:
+        ScopedTraceLabel(const ScopedTraceLabel &);
+        ScopedTraceLabel & operator=(const ScopedTraceLabel &);
+
+        /**
+         * The label that was active when this object was created.
+         */
+        const std::string * previous;
+    };
+
+} // namespace chianti
+
+#endif
@@ -9,13 +9,18 @@
 #ifndef CHIANTI_TYPES_H
 #define CHIANTI_TYPES_H
 
+#include <cstddef>
 #include <cstring>
 #include <cstdlib>
+#include <cstdint>
+#include <cmath>
 #include <array>
 #include <memory>
 
 #include <opencv2/opencv.hpp>
 
+#include "memory.h"
+
 namespace chianti {
 
     /**
@@ -31,12 +36,108 @@ namespace chianti {
      * image and the target is a 1-channel 8-bit image.
      */
     struct ImageTargetPair {
+        ImageTargetPair() : imageReduction(1) {}
+
+        ImageTargetPair(const cv::Mat & _image, const cv::Mat & _target) :
+        image(_image),
+        target(_target),
+        imageReduction(1) {}
+
         cv::Mat image;
         cv::Mat target;
+        /**
+         * The factor by which the image has been downscaled while decoding 
+         * it, but the target has not. It is consumed by the 
+         * SubsampleAugmentor and is 1 for all other pairs.
+         */
+        int imageReduction;
+        /**
+         * The size of the image at full resolution. Only set if 
+         * imageReduction is greater than 1.
+         */
+        cv::Size originalImageSize;
     };
 
     /**
-     * A tensor that stores its values in a row major ordering.
+     * An IEEE 754 half precision floating point number. It is only used as a
+     * storage format.
+     */
+    struct float16 {
+        /**
+         * Converts a single precision number to half precision. The value is
+         * rounded to the nearest representable value (ties to even).
+         * 
+         * @param value The value to convert.
+         * @return The half precision value.
+         */
+        static float16 fromFloat(float value) {
+            const uint32_t infinity = 255u << 23;
+            const uint32_t overflow = (127u + 16u) << 23;
+            const uint32_t denormalMagic = ((127u - 15u) + (23u - 10u) + 1u) 
+                    << 23;
+
+            uint32_t x;
+            std::memcpy(&x, &value, sizeof (x));
+            const uint32_t sign = x & 0x80000000u;
+            x ^= sign;
+
+            float16 result;
+            if (x >= overflow) {
+                // Infinity or NaN
+                result.bits = x > infinity ? 0x7E00 : 0x7C00;
+            } else if (x < (113u << 23)) {
+                // The result is a denormal number. Let the FPU do the 
+                // rounding by adding a magic number.
+                float f, magic;
+                std::memcpy(&f, &x, sizeof (f));
+                std::memcpy(&magic, &denormalMagic, sizeof (magic));
+                f += magic;
+                std::memcpy(&x, &f, sizeof (x));
+                result.bits = static_cast<uint16_t>(x - denormalMagic);
+            } else {
+                // Re-bias the exponent and round the mantissa
+                const uint32_t odd = (x >> 13) & 1u;
+                x += (static_cast<uint32_t>(15 - 127) << 23) + 0xFFFu + odd;
+                result.bits = static_cast<uint16_t>(x >> 13);
+            }
+            result.bits |= static_cast<uint16_t>(sign >> 16);
+            return result;
+        }
+
+        /**
+         * Converts the number to single precision.
+         * 
+         * @return The single precision value.
+         */
+        float toFloat() const {
+            const uint32_t sign = static_cast<uint32_t>(bits & 0x8000) << 16;
+            const uint32_t exponent = (bits >> 10) & 0x1F;
+            const uint32_t mantissa = bits & 0x3FF;
+
+            uint32_t x;
+            if (exponent == 0) {
+                // Zero or denormal number
+                float f = std::ldexp(static_cast<float>(mantissa), -24);
+                std::memcpy(&x, &f, sizeof (x));
+                x |= sign;
+            } else if (exponent == 31) {
+                // Infinity or NaN
+                x = sign | 0x7F800000u | (mantissa << 13);
+            } else {
+                x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+            }
+
+            float result;
+            std::memcpy(&result, &x, sizeof (result));
+            return result;
+        }
+
+        uint16_t bits;
+    };
+
+    /**
+     * A tensor that stores its values in a row major ordering. The storage is
+     * aligned to 64 bytes and not initialized.
      */
     template<typename T, int Rank>
     class Tensor {
@@ -59,19 +160,30 @@ namespace chianti {
         /**
          * Copies the tensor.
          */
-        Tensor(const Tensor<T, Rank> & other) {
-            shape = other.shape;
-            data.resize(getSize());
-            data.insert(data.begin(), other.data.begin(), other.data.end());
+        Tensor(const Tensor<T, Rank> & other) = default;
+
+        /**
+         * Moves the tensor.
+         */
+        Tensor(Tensor<T, Rank> && other) noexcept : 
+        shape(other.shape), 
+        data(std::move(other.data)) {
+            other.shape = std::array<int, Rank>();
         }
 
         /**
          * Assignment operator.
          */
-        Tensor & operator=(const Tensor & other) {
+        Tensor & operator=(const Tensor & other) = default;
+
+        /**
+         * Move assignment operator.
+         */
+        Tensor & operator=(Tensor && other) noexcept {
             if (this != &other) {
-                reshape(other.shape);
-                data.insert(data.begin(), other.data.begin(), other.data.end());
+                shape = other.shape;
+                data = std::move(other.data);
+                other.shape = std::array<int, Rank>();
             }
             return *this;
         }
@@ -81,16 +193,18 @@ namespace chianti {
          * 
          * @return The total size of the tensor.
          */
-        int getSize() const {
-            int size = 1;
+        std::size_t getSize() const {
+            // Batches of one-hot targets can exceed the range of int
+            std::size_t size = 1;
             for (int r = 0; r < Rank; r++) {
-                size *= shape[r];
+                size *= static_cast<std::size_t>(shape[r]);
             }
             return size;
         }
         
         /**
-         * Reshapes the tensor. Data may get corrupted.
+         * Reshapes the tensor. Data may get corrupted. Memory is only 
+         * reallocated if the tensor grows.
          * 
          * @param newShape The new shape of the tensor.
          */
@@ -109,33 +223,179 @@ namespace chianti {
         }
         
         std::array<int, Rank> shape;
-        std::vector<T> data;
+        AlignedBuffer<T> data;
+    };
+
+    /**
+     * The memory layout of the images and one-hot targets in a batch.
+     */
+    enum class Layout {
+        /**
+         * Channels first: batchSize x channels x H x W.
+         */
+        NCHW,
+        /**
+         * Channels last: batchSize x H x W x channels.
+         */
+        NHWC
     };
 
     /**
-     * A batch of images and targets. 
+     * The element type of the images in a batch.
+     */
+    enum class ImageFormat {
+        /**
+         * Float values in [0, 1].
+         */
+        Float32,
+        /**
+         * Half precision values in [0, 1].
+         */
+        Float16,
+        /**
+         * Un-normalized 8-bit values in [0, 255].
+         */
+        UInt8
+    };
+
+    /**
+     * The encoding of the targets in a batch.
+     */
+    enum class TargetFormat {
+        /**
+         * Float tensor of shape batchSize x numClasses x H x W.
+         */
+        OneHot,
+        /**
+         * 8-bit label map of shape batchSize x H x W.
+         */
+        UInt8Labels,
+        /**
+         * 32-bit label map of shape batchSize x H x W.
+         */
+        Int32Labels
+    };
+
+    /**
+     * Describes the shape and encoding of a batch.
+     */
+    struct BatchFormat {
+        BatchFormat() : 
+        batchSize(0), 
+        numClasses(0), 
+        imageSize({{0, 0}}),
+        targetSize({{0, 0}}),
+        layout(Layout::NCHW),
+        imageFormat(ImageFormat::Float32),
+        targetFormat(TargetFormat::OneHot) {}
+        
+        /**
+         * The number of samples in the batch.
+         */
+        int batchSize;
+        /**
+         * The number of classes.
+         */
+        int numClasses;
+        /**
+         * The size (rows, cols) of the images.
+         */
+        std::array<int, 2> imageSize;
+        /**
+         * The size (rows, cols) of the targets.
+         */
+        std::array<int, 2> targetSize;
+        /**
+         * The memory layout of the images and one-hot targets.
+         */
+        Layout layout;
+        /**
+         * The element type of the images.
+         */
+        ImageFormat imageFormat;
+        /**
+         * The encoding of the targets.
+         */
+        TargetFormat targetFormat;
+    };
+
+    /**
+     * A batch of images and targets. Depending on the image format, the images
+     * are stored in images (float32), halfImages (float16) or byteImages 
+     * (uint8). Depending on the target format, the targets are either stored 
+     * in targets (one-hot) or in one of the label tensors. The unused tensors
+     * are empty. Labels keep the ignore value 255. Images and one-hot targets
+     * are stored channels first or channels last depending on the layout.
+     * 
+     * Only the first size samples are valid. size is smaller than the batch 
+     * size for the partial last batch of an epoch. epoch is the epoch that 
+     * the samples belong to.
      */
     class Batch {
     public:
         /**
          * Initializes a new instance of the Batch class.
          */
-        Batch() {}
+        Batch() : size(0), epoch(0) {}
         
         /**
          * Initializes a new instance of the Batch class.
          * 
-         * @param imagesShape The shape of the images tensor.
-         * @param targetsShape The shape of the targets tensor.
-         */
-        Batch(
-                const std::array<int, 4> & imagesShape,
-                const std::array<int, 4> & targetsShape) :
-        images(imagesShape),
-        targets(targetsShape) {}
+         * @param _format The shape and encoding of the batch.
+         */
+        explicit Batch(const BatchFormat & _format) :
+        format(_format),
+        size(_format.batchSize),
+        epoch(0) {
+            const bool channelsLast = format.layout == Layout::NHWC;
+            const std::array<int, 4> imagesShape = channelsLast ? 
+                std::array<int, 4>{{format.batchSize, format.imageSize[0], 
+                        format.imageSize[1], 3}} :
+                std::array<int, 4>{{format.batchSize, 3, format.imageSize[0], 
+                        format.imageSize[1]}};
+            const std::array<int, 4> targetsShape = channelsLast ? 
+                std::array<int, 4>{{format.batchSize, format.targetSize[0], 
+                        format.targetSize[1], format.numClasses}} :
+                std::array<int, 4>{{format.batchSize, format.numClasses, 
+                        format.targetSize[0], format.targetSize[1]}};
+            const std::array<int, 3> labelsShape = {{
+                format.batchSize, format.targetSize[0], format.targetSize[1]
+            }};
+            
+            switch (format.imageFormat) {
+                case ImageFormat::Float32:
+                    images.reshape(imagesShape);
+                    break;
+                case ImageFormat::Float16:
+                    halfImages.reshape(imagesShape);
+                    break;
+                case ImageFormat::UInt8:
+                    byteImages.reshape(imagesShape);
+                    break;
+            }
+            
+            switch (format.targetFormat) {
+                case TargetFormat::OneHot:
+                    targets.reshape(targetsShape);
+                    break;
+                case TargetFormat::UInt8Labels:
+                    labels.reshape(labelsShape);
+                    break;
+                case TargetFormat::Int32Labels:
+                    wideLabels.reshape(labelsShape);
+                    break;
+            }
+        }
         
+        BatchFormat format;
+        int size;
+        int epoch;
         Tensor<float, 4> images;
+        Tensor<float16, 4> halfImages;
+        Tensor<uchar, 4> byteImages;
         Tensor<float, 4> targets;
+        Tensor<uchar, 3> labels;
+        Tensor<int, 3> wideLabels;
     };
 
 } // namespace chianti
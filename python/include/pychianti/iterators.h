@@ -71,6 +71,14 @@ namespace pychianti {
         static IteratorAdapter createRandomIterator(
                 const boost::python::object & elementList);
 
+        /**
+         * Creates a chianti::RandomIterator with a fixed seed, so the order of
+         * the elements is reproducible.
+         */
+        static IteratorAdapter createSeededRandomIterator(
+                const boost::python::object & elementList, 
+                unsigned int seed);
+
         /**
          * This is a wrapper class for chianti::WeightedRandomIterator. It 
          * allows us to expose its API to python.
@@ -79,6 +87,15 @@ namespace pychianti {
                     const boost::python::object & elementList, 
                     const boost::python::object & weights);
 
+        /**
+         * Creates a chianti::WeightedRandomIterator with a fixed seed, so the 
+         * order of the elements is reproducible.
+         */
+        static IteratorAdapter createSeededWeightedRandomIterator(
+                    const boost::python::object & elementList, 
+                    const boost::python::object & weights,
+                    unsigned int seed);
+
     protected:
         /**
          * The underlying iterator instance.
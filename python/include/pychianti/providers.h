@@ -12,6 +12,7 @@
 #include <boost/python.hpp>
 
 #include <memory>
+#include <vector>
 
 #include "chianti/providers.h"
 #include "pychianti/augmentors.h"
@@ -39,6 +40,22 @@ namespace pychianti {
          * @param iterator A python object that wraps an iterator.
          * @param batchSize The batch size.
          * @param numClasses The number of classes.
+         * @param prefetchDepth The number of batches to prepare in advance.
+         * @param numWorkers The number of worker threads. If 0, one worker 
+         *                   per hardware thread is used.
+         * @param targetFormat The encoding of the targets.
+         * @param imageFormat The element type of the images.
+         * @param layout The memory layout of the images and one-hot targets.
+         * @param seed The seed of the deterministic mode. If negative, the 
+         *             augmentors draw from their own generators.
+         * @param numConsumers The number of consumers that share the 
+         *                     provider.
+         * @param partialBatches Whether the last batch of an epoch may be 
+         *                       smaller than the batch size.
+         * @param bucketing Whether samples are grouped by size.
+         * @param autotune Whether the number of active workers and the 
+         *                 prefetch depth are tuned at runtime. numWorkers and 
+         *                 prefetchDepth are the upper bounds.
          */
         DataProviderAdapter(
                 const AugmentorAdapter & augmentor, 
@@ -46,21 +63,43 @@ namespace pychianti {
                 const LoaderAdapter & targetLoader, 
                 const IteratorAdapter & iterator, 
                 int batchSize, 
-                int numClasses);
+                int numClasses,
+                int prefetchDepth = 1,
+                int numWorkers = 0,
+                chianti::TargetFormat targetFormat = 
+                        chianti::TargetFormat::OneHot,
+                chianti::ImageFormat imageFormat = 
+                        chianti::ImageFormat::Float32,
+                chianti::Layout layout = chianti::Layout::NCHW,
+                long seed = -1,
+                int numConsumers = 1,
+                bool partialBatches = false,
+                bool bucketing = false,
+                bool autotune = false,
+                long cacheBytes = 0);
         
         /**
-         * Returns the next batch of images. 
+         * Returns the next batch of images. The arrays of a partial batch 
+         * only contain the valid samples.
          * 
+         * @param consumer The index of the consumer.
          * @return A tuple of two numpy arrays
          */
-        boost::python::tuple  next();
+        boost::python::tuple  next(int consumer = 0);
+        
+        /**
+         * Returns the epoch of the batch that has last been returned to the 
+         * given consumer.
+         * 
+         * @param consumer The index of the consumer.
+         * @return The epoch or -1 if the consumer has not received a batch.
+         */
+        int getEpoch(int consumer = 0) const;
         
         /**
          * Resets the provider.
          */
-        void reset() {
-            provider->reset();
-        }
+        void reset();
         
         /**
          * Returns the number of batches. 
@@ -71,11 +110,89 @@ namespace pychianti {
             return provider->getNumBatches();
         }
         
+        /**
+         * Returns the number of consumers.
+         * 
+         * @return The number of consumers.
+         */
+        int getNumConsumers() const {
+            return provider->getNumConsumers();
+        }
+        
+        /**
+         * Returns the number of workers that currently load samples.
+         * 
+         * @return The number of active workers.
+         */
+        int getNumActiveWorkers() const {
+            return provider->getNumActiveWorkers();
+        }
+        
+        /**
+         * Returns the current prefetch depth.
+         * 
+         * @return The prefetch depth.
+         */
+        int getPrefetchDepth() const {
+            return provider->getPrefetchDepth();
+        }
+        
+        /**
+         * Returns the timing counters of the pipeline stages.
+         * 
+         * @return A dictionary that maps the name of each stage to a 
+         *         dictionary with the keys count, total and histogram.
+         */
+        boost::python::dict getStats() const;
+        
+        /**
+         * Returns the consumer stall time, the producer wait time, the queue
+         * occupancy histogram and the number of dropped samples.
+         * 
+         * @return A dictionary with the keys calls, stall, producer_wait, 
+         *         occupancy and dropped.
+         */
+        boost::python::dict getQueueMetrics() const;
+        
+        /**
+         * Sets all timing counters to zero.
+         */
+        void clearStats() {
+            provider->clearStats();
+        }
+        
+        /**
+         * Starts recording spans of the pipeline stages.
+         */
+        void startTracing() {
+            provider->startTracing();
+        }
+        
+        /**
+         * Stops recording spans of the pipeline stages.
+         */
+        void stopTracing() {
+            provider->stopTracing();
+        }
+        
+        /**
+         * Saves the recorded spans as Chrome trace JSON.
+         * 
+         * @param filename The name of the file.
+         */
+        void saveTrace(const std::string & filename) const {
+            provider->saveTrace(filename);
+        }
+        
     private:
         /**
          * The underlying reference to the data provider.
          */
         std::shared_ptr<chianti::DataProvider> provider;
+        /**
+         * The epoch of the last batch of each consumer.
+         */
+        std::vector<int> epochs;
     };
     
 } // namespace pychianti
@@ -65,6 +65,13 @@ namespace pychianti {
                 pythonTupleListToVector(elementList)));
     }
     
+    IteratorAdapter IteratorAdapter::createSeededRandomIterator(
+            const boost::python::object& elementList,
+            unsigned int seed) {
+        return IteratorAdapter(std::make_shared<chianti::RandomIterator>(
+                pythonTupleListToVector(elementList), seed));
+    }
+    
     IteratorAdapter IteratorAdapter::createWeightedRandomIterator(
             const boost::python::object& elementList,
             const boost::python::object& weights) {
@@ -73,5 +80,16 @@ namespace pychianti {
                 pythonTupleListToVector(elementList), 
                 pythonDoubleListToVector(weights)));
     }
+    
+    IteratorAdapter IteratorAdapter::createSeededWeightedRandomIterator(
+            const boost::python::object& elementList,
+            const boost::python::object& weights,
+            unsigned int seed) {
+        return IteratorAdapter(
+                std::make_shared<chianti::WeightedRandomIterator>(
+                pythonTupleListToVector(elementList), 
+                pythonDoubleListToVector(weights),
+                seed));
+    }
 
 } // namespace pychianti
\ No newline at end of file
@@ -13,8 +13,8 @@
 #include <boost/python/stl_iterator.hpp>
 #include <numpy/arrayobject.h>
 
+#include <algorithm>
 #include <array>
-#include <cstring>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -39,18 +39,57 @@ PyObject * wrap_imports() {
             const LoaderAdapter & targetLoader,
             const IteratorAdapter & iterator,
             int batchSize, 
-            int numClasses) {
+            int numClasses,
+            int prefetchDepth,
+            int numWorkers,
+            chianti::TargetFormat targetFormat,
+            chianti::ImageFormat imageFormat,
+            chianti::Layout layout,
+            long seed,
+            int numConsumers,
+            bool partialBatches,
+            bool bucketing,
+            bool autotune,
+            long cacheBytes) {
+
+        // Keep the decoded pairs in memory if a budget is given
+        std::shared_ptr<chianti::ImageTargetPairLoader> loader;
+        if (cacheBytes > 0) {
+            loader = std::make_shared<chianti::CachingImageTargetPairLoader>(
+                    imageLoader.getLoader(),
+                    targetLoader.getLoader(),
+                    static_cast<size_t>(cacheBytes));
+        } else {
+            loader = std::make_shared<chianti::ImageTargetPairLoader>(
+                    imageLoader.getLoader(),
+                    targetLoader.getLoader());
+        }
 
         provider = std::make_shared<chianti::DataProvider>(
                 augmentor.getAugmentor(),
-                std::make_shared<chianti::ImageTargetPairLoader>(
-                imageLoader.getLoader(),
-                targetLoader.getLoader()
-                ),
+                loader,
                 iterator.getIterator(),
                 batchSize, 
                 numClasses);
+        provider->setPrefetchDepth(prefetchDepth);
+        provider->setTargetFormat(targetFormat);
+        provider->setImageFormat(imageFormat);
+        provider->setLayout(layout);
+        if (numWorkers > 0) {
+            provider->setNumWorkers(numWorkers);
+        }
+        if (seed >= 0) {
+            provider->setSeed(static_cast<unsigned int>(seed));
+        }
+        provider->setNumConsumers(numConsumers);
+        provider->setPartialBatches(partialBatches);
+        provider->setBucketing(bucketing);
+        if (autotune) {
+            provider->enableAutotune(
+                    1, provider->getNumWorkers(), 1, prefetchDepth);
+        }
         provider->init();
+        epochs.assign(numConsumers, -1);
     }
 
     /**
@@ -66,36 +105,173 @@ PyObject * wrap_imports() {
     template<> struct GetNumpyType<int> {
         static constexpr NPY_TYPES type = NPY_INT32;
     };
+    template<> struct GetNumpyType<chianti::float16> {
+        static constexpr NPY_TYPES type = NPY_FLOAT16;
+    };
+    
+    /**
+     * The name of the capsules that keep batches alive.
+     */
+    static const char * const kBatchCapsuleName = "chianti.Batch";
     
     /**
-     * Converts a tensor to a numpy array.
+     * Releases the reference to a batch held by a capsule. Once all arrays
+     * that view the batch are gone, it returns to the provider's pool.
+     */
+    static void releaseBatchCapsule(PyObject * capsule) {
+        delete static_cast<std::shared_ptr<chianti::Batch>*>(
+                PyCapsule_GetPointer(capsule, kBatchCapsuleName));
+    }
+    
+    /**
+     * Wraps a tensor of a batch in a numpy array without copying the data. 
+     * The array only covers the valid samples and keeps the batch alive.
      */
     template<typename T, int Rank>
-    boost::python::object convertTensor(
-            const chianti::Tensor<T, Rank> & tensor) {
+    boost::python::object wrapTensor(
+            const chianti::Tensor<T, Rank> & tensor, 
+            const std::shared_ptr<chianti::Batch> & owner) {
+        std::array<npy_intp, Rank> dims;
+        std::copy(tensor.shape.begin(), tensor.shape.end(), dims.begin());
+        dims[0] = owner->size;
+        
+        PyObject * array = PyArray_SimpleNewFromData(
+                Rank, 
+                dims.data(), 
+                GetNumpyType<T>::type, 
+                const_cast<T*>(tensor.data.data()));
+        if (array == nullptr) {
+            boost::python::throw_error_already_set();
+        }
+        boost::python::handle<> handle(array);
+        
+        // Tie the lifetime of the batch to the array
+        std::unique_ptr<std::shared_ptr<chianti::Batch>> reference(
+                new std::shared_ptr<chianti::Batch>(owner));
+        PyObject * capsule = PyCapsule_New(
+                reference.get(), kBatchCapsuleName, &releaseBatchCapsule);
+        if (capsule == nullptr) {
+            boost::python::throw_error_already_set();
+        }
+        reference.release();
+        
+        // PyArray_SetBaseObject steals the reference to the capsule
+        if (PyArray_SetBaseObject(
+                reinterpret_cast<PyArrayObject*>(array), capsule) != 0) {
+            boost::python::throw_error_already_set();
+        }
+        
+        return boost::python::object(handle);
+    }
 
-        PyArrayObject* result = (PyArrayObject*) PyArray_FromDims(
-                static_cast<int>(tensor.shape.size()), 
-                const_cast<int*>(tensor.shape.data()), 
-                GetNumpyType<T>::type);
+    /**
+     * Releases the global interpreter lock for the lifetime of the object. 
+     * No python API may be used while the lock is released.
+     */
+    class ScopedGILRelease {
+    public:
+        ScopedGILRelease() : state(PyEval_SaveThread()) {}
+        
+        ~ScopedGILRelease() {
+            PyEval_RestoreThread(state);
+        }
         
-        // Copy the data 
-        std::memcpy(PyArray_BYTES(result),
-                tensor.data.data(),
-                tensor.getSize() * sizeof (T));
+    private:
+        ScopedGILRelease(const ScopedGILRelease &);
+        ScopedGILRelease & operator=(const ScopedGILRelease &);
         
-        // Wrap the pointer in a boost python object
-        boost::python::handle<> handle(reinterpret_cast<PyObject*>(result));
-        boost::python::object object(handle);
-        return object;
+        /**
+         * The saved thread state.
+         */
+        PyThreadState * state;
+    };
+
+    boost::python::tuple DataProviderAdapter::next(int consumer) {
+        // Wait for the next batch without blocking other python threads. The
+        // arrays share ownership of it.
+        std::shared_ptr<chianti::Batch> batch;
+        {
+            ScopedGILRelease release;
+            batch = provider->next(consumer);
+        }
+        epochs[consumer] = batch->epoch;
+
+        boost::python::object images;
+        switch (batch->format.imageFormat) {
+            case chianti::ImageFormat::Float32:
+                images = wrapTensor(batch->images, batch);
+                break;
+            case chianti::ImageFormat::Float16:
+                images = wrapTensor(batch->halfImages, batch);
+                break;
+            case chianti::ImageFormat::UInt8:
+                images = wrapTensor(batch->byteImages, batch);
+                break;
+        }
+
+        boost::python::object targets;
+        switch (batch->format.targetFormat) {
+            case chianti::TargetFormat::OneHot:
+                targets = wrapTensor(batch->targets, batch);
+                break;
+            case chianti::TargetFormat::UInt8Labels:
+                targets = wrapTensor(batch->labels, batch);
+                break;
+            case chianti::TargetFormat::Int32Labels:
+                targets = wrapTensor(batch->wideLabels, batch);
+                break;
+        }
+
+        return boost::python::make_tuple(images, targets);
     }
 
-    boost::python::tuple DataProviderAdapter::next() {
-        // Get the next batch
-        auto batch = provider->next();
+    int DataProviderAdapter::getEpoch(int consumer) const {
+        if (consumer < 0 || consumer >= static_cast<int>(epochs.size())) {
+            throw std::runtime_error("Invalid consumer.");
+        }
+        return epochs[consumer];
+    }
+
+    boost::python::dict DataProviderAdapter::getStats() const {
+        boost::python::dict result;
+        auto stages = provider->getStats();
+        for (auto i = stages.begin(); i != stages.end(); i++) {
+            boost::python::list histogram;
+            for (auto j = i->histogram.begin(); j != i->histogram.end(); j++) {
+                histogram.append(*j);
+            }
+
+            boost::python::dict stage;
+            stage["count"] = i->count;
+            stage["total"] = i->totalSeconds;
+            stage["histogram"] = histogram;
+            result[i->name] = stage;
+        }
+        return result;
+    }
+
+    boost::python::dict DataProviderAdapter::getQueueMetrics() const {
+        auto metrics = provider->getQueueMetrics();
+        boost::python::list occupancy;
+        for (auto i = metrics.occupancy.begin(); 
+                i != metrics.occupancy.end(); i++) {
+            occupancy.append(*i);
+        }
+
+        boost::python::dict result;
+        result["calls"] = metrics.numCalls;
+        result["stall"] = metrics.stallSeconds;
+        result["producer_wait"] = metrics.producerWaitSeconds;
+        result["occupancy"] = occupancy;
+        result["dropped"] = metrics.numDroppedSamples;
+        return result;
+    }
 
-        return boost::python::make_tuple(convertTensor(batch->images), 
-                convertTensor(batch->targets));
+    void DataProviderAdapter::reset() {
+        // Workers may hold the provider's lock briefly, so do not block other
+        // python threads while waiting for it
+        ScopedGILRelease release;
+        provider->reset();
     }
 
 } // namespace pychianti
\ No newline at end of file
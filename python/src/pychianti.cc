@@ -22,6 +22,12 @@
 #include "pychianti/loaders.h"
 #include "pychianti/providers.h"
 
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
+        DataProviderNextOverloads, pychianti::DataProviderAdapter::next, 0, 1)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
+        DataProviderGetEpochOverloads, 
+        pychianti::DataProviderAdapter::getEpoch, 0, 1)
+
 BOOST_PYTHON_MODULE(pychianti) {
     pychianti::wrap_imports();
     
@@ -63,8 +69,12 @@ BOOST_PYTHON_MODULE(pychianti) {
                     &pychianti::IteratorAdapter::createSequentialIterator)
             .def("Random", 
                     &pychianti::IteratorAdapter::createRandomIterator)
+            .def("Random", 
+                    &pychianti::IteratorAdapter::createSeededRandomIterator)
             .def("WeightedRandom", 
                     &pychianti::IteratorAdapter::createWeightedRandomIterator)
+            .def("WeightedRandom", &pychianti::IteratorAdapter::
+                    createSeededWeightedRandomIterator)
             .staticmethod("Sequential")
             .staticmethod("Random")
             .staticmethod("WeightedRandom");
@@ -84,12 +94,64 @@ BOOST_PYTHON_MODULE(pychianti) {
             .staticmethod("ColorMapper");
             
    // DATA PROVIDER
+    boost::python::enum_<chianti::Layout>("Layout")
+            .value("NCHW", chianti::Layout::NCHW)
+            .value("NHWC", chianti::Layout::NHWC);
+    
+    boost::python::enum_<chianti::ImageFormat>("ImageFormat")
+            .value("Float32", chianti::ImageFormat::Float32)
+            .value("Float16", chianti::ImageFormat::Float16)
+            .value("UInt8", chianti::ImageFormat::UInt8);
+    
+    boost::python::enum_<chianti::TargetFormat>("TargetFormat")
+            .value("OneHot", chianti::TargetFormat::OneHot)
+            .value("UInt8Labels", chianti::TargetFormat::UInt8Labels)
+            .value("Int32Labels", chianti::TargetFormat::Int32Labels);
+    
     boost::python::class_<
             pychianti::DataProviderAdapter> (
             "DataProvider", boost::python::init<pychianti::AugmentorAdapter,
             pychianti::LoaderAdapter, pychianti::LoaderAdapter, 
-            pychianti::IteratorAdapter, int, int>())
-            .def("next", &pychianti::DataProviderAdapter::next)
+            pychianti::IteratorAdapter, int, int, int, int, 
+            chianti::TargetFormat, chianti::ImageFormat, chianti::Layout, 
+            long, int, bool, bool, bool, long>((
+                    boost::python::arg("augmentor"),
+                    boost::python::arg("source_img_loader"),
+                    boost::python::arg("target_img_loader"),
+                    boost::python::arg("iterator"),
+                    boost::python::arg("batch_size"),
+                    boost::python::arg("num_classes"),
+                    boost::python::arg("prefetch_depth") = 1,
+                    boost::python::arg("num_workers") = 0,
+                    boost::python::arg("target_format") = 
+                            chianti::TargetFormat::OneHot,
+                    boost::python::arg("image_format") = 
+                            chianti::ImageFormat::Float32,
+                    boost::python::arg("layout") = chianti::Layout::NCHW,
+                    boost::python::arg("seed") = -1,
+                    boost::python::arg("num_consumers") = 1,
+                    boost::python::arg("partial_batches") = false,
+                    boost::python::arg("bucketing") = false,
+                    boost::python::arg("autotune") = false,
+                    boost::python::arg("cache_bytes") = 0)))
+            .def("next", &pychianti::DataProviderAdapter::next, 
+                    DataProviderNextOverloads())
             .def("reset", &pychianti::DataProviderAdapter::reset)
-            .def("get_num_batches", &pychianti::DataProviderAdapter::getNumBatches);
+            .def("get_epoch", &pychianti::DataProviderAdapter::getEpoch, 
+                    DataProviderGetEpochOverloads())
+            .def("get_num_batches", &pychianti::DataProviderAdapter::getNumBatches)
+            .def("get_num_consumers", 
+                    &pychianti::DataProviderAdapter::getNumConsumers)
+            .def("get_num_active_workers", 
+                    &pychianti::DataProviderAdapter::getNumActiveWorkers)
+            .def("get_prefetch_depth", 
+                    &pychianti::DataProviderAdapter::getPrefetchDepth)
+            .def("get_stats", &pychianti::DataProviderAdapter::getStats)
+            .def("get_queue_metrics", 
+                    &pychianti::DataProviderAdapter::getQueueMetrics)
+            .def("clear_stats", &pychianti::DataProviderAdapter::clearStats)
+            .def("start_tracing", 
+                    &pychianti::DataProviderAdapter::startTracing)
+            .def("stop_tracing", &pychianti::DataProviderAdapter::stopTracing)
+            .def("save_trace", &pychianti::DataProviderAdapter::saveTrace);
 }
@@ -10,16 +10,99 @@
 
 #include "fastlog.h"
 
+#include <algorithm>
 #include <cstring>
 #include <exception>
 #include <limits>
+#include <sstream>
 #include <string.h>
 
 namespace chianti {
 
+    void RandomAugmentor::augment(ImageTargetPair& pair) {
+        RandomEngine engine(
+                seed, nextStream.fetch_add(1, std::memory_order_relaxed));
+        augment(pair, engine);
+    }
+
     void CombinedAugmentor::augment(ImageTargetPair& pair) {
-        for (auto i = augmentors.begin(); i != augmentors.end(); i++) {
-            (*i)->augment(pair);
+        for (size_t i = 0; i < augmentors.size(); i++) {
+            ScopedStageTimer timer(i < stages.size() ? stages[i] : nullptr);
+            augmentors[i]->augment(pair);
+        }
+    }
+
+    void CombinedAugmentor::augment(ImageTargetPair& pair, RandomEngine& g) {
+        for (size_t i = 0; i < augmentors.size(); i++) {
+            ScopedStageTimer timer(i < stages.size() ? stages[i] : nullptr);
+            auto engine = g.split(static_cast<uint32_t>(i));
+            augmentors[i]->augment(pair, engine);
+        }
+    }
+
+    bool CombinedAugmentor::isDeterministic() const {
+        for (size_t i = 0; i < augmentors.size(); i++) {
+            if (!augmentors[i]->isDeterministic()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::string CombinedAugmentor::getDescription() const {
+        std::stringstream description;
+        description << getName() << "(";
+        for (size_t i = 0; i < augmentors.size(); i++) {
+            description << (i > 0 ? ", " : "") 
+                    << augmentors[i]->getDescription();
+        }
+        description << ")";
+        return description.str();
+    }
+
+    void CombinedAugmentor::instrument(
+            std::shared_ptr<Stats> _stats, 
+            const std::string& prefix) {
+        stats = _stats;
+        stages.clear();
+        for (size_t i = 0; i < augmentors.size(); i++) {
+            std::stringstream name;
+            name << prefix << i << "." << augmentors[i]->getName();
+            stages.push_back(&stats->getStage(name.str()));
+
+            // Nested augmentors record their steps below this one
+            augmentors[i]->instrument(stats, name.str() + ".");
+        }
+    }
+
+    std::string SubsampleAugmentor::getDescription() const {
+        std::stringstream description;
+        description << getName() << "(" << factor << ")";
+        return description.str();
+    }
+
+    void SubsampleAugmentor::augment(ImageTargetPair& pair) {
+        resizeTarget(pair.target);
+
+        if (pair.imageReduction != factor) {
+            resizeImage(pair.image);
+            return;
+        }
+
+        // The decoder rounds the size of the image up, while subsampling 
+        // rounds it down. The target may have a different resolution, so the
+        // size follows from the original image.
+        pair.imageReduction = 1;
+        const cv::Size size(
+                pair.originalImageSize.width / factor, 
+                pair.originalImageSize.height / factor);
+        if (pair.image.cols < size.width || pair.image.rows < size.height) {
+            cv::resize(pair.image, pair.image, size, 0, 0, 
+                    CV_INTER_LANCZOS4);
+        } else if (pair.image.cols != size.width || 
+                pair.image.rows != size.height) {
+            const cv::Rect region(0, 0, size.width, size.height);
+            pair.image = pair.image(region).clone();
         }
     }
 
@@ -70,13 +153,11 @@ namespace chianti {
         tNew.copyTo(target);
     }
 
-    void GammaAugmentor::augment(ImageTargetPair& pair) {
+    void GammaAugmentor::augment(ImageTargetPair& pair, RandomEngine& g) {
         // Sample the gamma value
         double gamma;
-        {
-            std::lock_guard<std::mutex> lock(rngMutex);
-            gamma = d(g);
-        }
+        auto distribution = d;
+        gamma = distribution(g);
 
         // Apply the non-linear transformation
         const double inv_sqrt_2 = 1.0 / std::sqrt(2.0);
@@ -90,14 +171,12 @@ namespace chianti {
         cv::pow(pair.image, float_gamma, pair.image);
     }
 
-    void TranslationAugmentor::augment(ImageTargetPair& pair) {
+    void TranslationAugmentor::augment(ImageTargetPair& pair, RandomEngine& g) {
         // Sample the translation offset in each direction
         int translation_x, translation_y;
-        {
-            std::lock_guard<std::mutex> lock(rngMutex);
-            translation_x = d(g);
-            translation_y = d(g);
-        }
+        auto distribution = d;
+        translation_x = distribution(g);
+        translation_y = distribution(g);
 
         cv::Mat iNew(pair.image.rows, pair.image.cols, CV_32FC3);
         cv::Mat tNew(pair.target.rows, pair.target.cols, CV_8UC1);
@@ -147,13 +226,11 @@ namespace chianti {
         pair.target = tNew;
     }
 
-    void ZoomingAugmentor::augment(ImageTargetPair& pair) {
+    void ZoomingAugmentor::augment(ImageTargetPair& pair, RandomEngine& g) {
         // Sample the zooming factor
         double factor;
-        {
-            std::lock_guard<std::mutex> lock(rngMutex);
-            factor = d(g);
-        }
+        auto distribution = d;
+        factor = distribution(g);
 
         // Compute the new image size
         const int rows = static_cast<int> (pair.image.rows * factor);
@@ -204,13 +281,11 @@ namespace chianti {
         }
     }
 
-    void RotationAugmentor::augment(ImageTargetPair& pair) {
+    void RotationAugmentor::augment(ImageTargetPair& pair, RandomEngine& g) {
         // Sample the rotation angle
         double factor;
-        {
-            std::lock_guard<std::mutex> lock(rngMutex);
-            factor = d(g);
-        }
+        auto distribution = d;
+        factor = distribution(g);
         
         if (factor < 0) {
             factor += 360;
@@ -230,12 +305,10 @@ namespace chianti {
                 CV_INTER_NN, cv::BORDER_CONSTANT, 255);
     }
 
-    void SaturationAugmentor::augment(ImageTargetPair& pair) {
+    void SaturationAugmentor::augment(ImageTargetPair& pair, RandomEngine& g) {
         float offset;
-        {
-            std::lock_guard<std::mutex> lock(rngMutex);
-            offset = static_cast<float> (d(g));
-        }
+        auto distribution = d;
+        offset = static_cast<float> (distribution(g));
         
         cv::Mat iNew;
         cv::cvtColor(pair.image, iNew, CV_RGB2HSV);
@@ -253,12 +326,10 @@ namespace chianti {
         cv::cvtColor(iNew, pair.image, CV_HSV2RGB);
     }
 
-    void HueAugmentor::augment(ImageTargetPair& pair) {
+    void HueAugmentor::augment(ImageTargetPair& pair, RandomEngine& g) {
         float offset;
-        {
-            std::lock_guard<std::mutex> lock(rngMutex);
-            offset = static_cast<float> (d(g));
-        }
+        auto distribution = d;
+        offset = static_cast<float> (distribution(g));
         
         cv::Mat iNew;
         cv::cvtColor(pair.image, iNew, CV_RGB2HSV);
@@ -453,13 +524,11 @@ namespace chianti {
     
     std::array<int, 2> CropAugmentor::samplePosition(
             const cv::Mat& target, 
-            const cv::Mat& distribution) {
+            const cv::Mat& distribution,
+            RandomEngine& g) const {
         // Sample a random number
-        float u;
-        {
-            std::lock_guard<std::mutex> lock(rngMutex);
-            u = d(g);
-        }
+        auto uniform = d;
+        float u = uniform(g);
         
         // Get the index of the cumulative distribution that corresponds to the
         // drawn number
@@ -480,7 +549,7 @@ namespace chianti {
         return {row, col};
     }
     
-    void CropAugmentor::augment(ImageTargetPair& pair) {
+    void CropAugmentor::augment(ImageTargetPair& pair, RandomEngine& g) {
         // Compute the pixel-wise class histograms
         cv::Mat histograms;
         computeClassHistograms(pair.target, histograms);
@@ -491,7 +560,7 @@ namespace chianti {
         computeCumulativeDistribution(histograms, distribution);
         
         // Sample a crop position from the distribution
-        auto position = samplePosition(pair.target, distribution);
+        auto position = samplePosition(pair.target, distribution, g);
         
         // Extract the crop
         cv::Mat iNew(size, size, CV_32FC3);
@@ -0,0 +1,267 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+#include "collate.h"
+
+#include "sse.h"
+
+#if defined(__AVX__) || defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace chianti {
+
+    /**
+     * Converts a single value to the destination type. NaN becomes 0.
+     */
+    static inline void convertValue(float value, float & dest) {
+        dest = std::isnan(value) ? 0.0f : value;
+    }
+
+    static inline void convertValue(float value, float16 & dest) {
+        dest = float16::fromFloat(std::isnan(value) ? 0.0f : value);
+    }
+
+    static inline void convertValue(float value, uchar & dest) {
+        // Round to nearest even like the vectorized version
+        const float scaled = std::isnan(value) ? 
+                0.0f : std::nearbyint(255.0f * value);
+        dest = static_cast<uchar>(std::max(0.0f, std::min(255.0f, scaled)));
+    }
+
+#ifdef __SSE2__
+    /**
+     * Loads four interleaved RGB pixels, replaces NaN values by 0 and 
+     * transposes them to one vector per channel.
+     */
+    static inline void deinterleave4(
+            const float * src, v4sf & r, v4sf & g, v4sf & b) {
+        v4sf a = _mm_loadu_ps(src);
+        v4sf c = _mm_loadu_ps(src + 4);
+        v4sf d = _mm_loadu_ps(src + 8);
+        
+        // NaN is the only value that is unordered with respect to itself
+        a = _mm_and_ps(a, _mm_cmpord_ps(a, a));
+        c = _mm_and_ps(c, _mm_cmpord_ps(c, c));
+        d = _mm_and_ps(d, _mm_cmpord_ps(d, d));
+        
+        // a = r0 g0 b0 r1, c = g1 b1 r2 g2, d = b2 r3 g3 b3
+        const v4sf rHigh = _mm_shuffle_ps(c, d, _MM_SHUFFLE(1, 0, 3, 2));
+        r = _mm_shuffle_ps(a, rHigh, _MM_SHUFFLE(3, 0, 3, 0));
+        
+        const v4sf gLow = _mm_shuffle_ps(a, c, _MM_SHUFFLE(0, 0, 1, 1));
+        const v4sf gHigh = _mm_shuffle_ps(c, d, _MM_SHUFFLE(2, 2, 3, 3));
+        g = _mm_shuffle_ps(gLow, gHigh, _MM_SHUFFLE(2, 0, 2, 0));
+        
+        const v4sf bLow = _mm_shuffle_ps(a, c, _MM_SHUFFLE(1, 0, 3, 2));
+        b = _mm_shuffle_ps(bLow, d, _MM_SHUFFLE(3, 0, 3, 0));
+    }
+
+    /**
+     * Stores four values of one channel.
+     */
+    static inline void store4(v4sf values, float * dest) {
+        _mm_storeu_ps(dest, values);
+    }
+
+    static inline void store4(v4sf values, float16 * dest) {
+#ifdef __F16C__
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dest), 
+                _mm_cvtps_ph(values, _MM_FROUND_TO_NEAREST_INT));
+#else
+        float tmp[4];
+        _mm_storeu_ps(tmp, values);
+        for (int k = 0; k < 4; k++) {
+            dest[k] = float16::fromFloat(tmp[k]);
+        }
+#endif
+    }
+
+    static inline void store4(v4sf values, uchar * dest) {
+        // Clamp before the conversion, which maps infinite and out of range
+        // values to INT_MIN, then round to nearest even
+        const v4sf clamped = _mm_min_ps(_mm_max_ps(
+                _mm_mul_ps(values, _mm_set1_ps(255.0f)), 
+                _mm_setzero_ps()), _mm_set1_ps(255.0f));
+        const v4si scaled = _mm_cvtps_epi32(clamped);
+        const v4si words = _mm_packs_epi32(scaled, scaled);
+        const int bytes = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+        std::memcpy(dest, &bytes, 4);
+    }
+#endif
+
+#ifdef __AVX__
+    /**
+     * Transposes as many pixels of a row as possible in blocks of eight. Only
+     * float destinations are vectorized this way.
+     * 
+     * @return The number of pixels that have been processed.
+     */
+    static inline int rowToPlanarWide(
+            const float * src, int cols, float * r, float * g, float * b) {
+        int j = 0;
+        for (; j + 8 <= cols; j += 8) {
+            // Put pixels 0-3 into the lower and pixels 4-7 into the upper 
+            // lane. Then the 128-bit shuffles can be applied per lane.
+            const float * p = src + 3 * j;
+            __m256 a = _mm256_insertf128_ps(_mm256_castps128_ps256(
+                    _mm_loadu_ps(p)), _mm_loadu_ps(p + 12), 1);
+            __m256 c = _mm256_insertf128_ps(_mm256_castps128_ps256(
+                    _mm_loadu_ps(p + 4)), _mm_loadu_ps(p + 16), 1);
+            __m256 d = _mm256_insertf128_ps(_mm256_castps128_ps256(
+                    _mm_loadu_ps(p + 8)), _mm_loadu_ps(p + 20), 1);
+            
+            a = _mm256_and_ps(a, _mm256_cmp_ps(a, a, _CMP_ORD_Q));
+            c = _mm256_and_ps(c, _mm256_cmp_ps(c, c, _CMP_ORD_Q));
+            d = _mm256_and_ps(d, _mm256_cmp_ps(d, d, _CMP_ORD_Q));
+            
+            const __m256 rHigh = _mm256_shuffle_ps(
+                    c, d, _MM_SHUFFLE(1, 0, 3, 2));
+            _mm256_storeu_ps(r + j, _mm256_shuffle_ps(
+                    a, rHigh, _MM_SHUFFLE(3, 0, 3, 0)));
+            
+            const __m256 gLow = _mm256_shuffle_ps(
+                    a, c, _MM_SHUFFLE(0, 0, 1, 1));
+            const __m256 gHigh = _mm256_shuffle_ps(
+                    c, d, _MM_SHUFFLE(2, 2, 3, 3));
+            _mm256_storeu_ps(g + j, _mm256_shuffle_ps(
+                    gLow, gHigh, _MM_SHUFFLE(2, 0, 2, 0)));
+            
+            const __m256 bLow = _mm256_shuffle_ps(
+                    a, c, _MM_SHUFFLE(1, 0, 3, 2));
+            _mm256_storeu_ps(b + j, _mm256_shuffle_ps(
+                    bLow, d, _MM_SHUFFLE(3, 0, 3, 0)));
+        }
+        return j;
+    }
+#endif
+
+    template<typename T>
+    static inline int rowToPlanarWide(const float *, int, T *, T *, T *) {
+        return 0;
+    }
+
+    /**
+     * Transposes a single row of interleaved pixels to planar channels.
+     */
+    template<typename T>
+    static void rowToPlanar(
+            const float * src, int cols, T * r, T * g, T * b) {
+        int j = rowToPlanarWide(src, cols, r, g, b);
+        
+#ifdef __SSE2__
+        for (; j + 4 <= cols; j += 4) {
+            v4sf vr, vg, vb;
+            deinterleave4(src + 3 * j, vr, vg, vb);
+            store4(vr, r + j);
+            store4(vg, g + j);
+            store4(vb, b + j);
+        }
+#endif
+        
+        // Remaining pixels
+        for (; j < cols; j++) {
+            convertValue(src[3 * j], r[j]);
+            convertValue(src[3 * j + 1], g[j]);
+            convertValue(src[3 * j + 2], b[j]);
+        }
+    }
+
+    template<typename T>
+    static void imageToPlanar(const cv::Mat & image, T * dest) {
+        const int planeSize = image.rows * image.cols;
+        for (int i = 0; i < image.rows; i++) {
+            const int offset = i * image.cols;
+            rowToPlanar(image.ptr<float>(i), image.cols, 
+                    dest + offset, 
+                    dest + planeSize + offset, 
+                    dest + 2 * planeSize + offset);
+        }
+    }
+
+#ifdef __AVX__
+    /**
+     * Copies as many values of a row as possible in blocks of eight. Only
+     * float destinations are vectorized this way.
+     * 
+     * @return The number of values that have been processed.
+     */
+    static inline int copyRowWide(const float * src, int count, float * dest) {
+        int k = 0;
+        for (; k + 8 <= count; k += 8) {
+            __m256 values = _mm256_loadu_ps(src + k);
+            values = _mm256_and_ps(values, 
+                    _mm256_cmp_ps(values, values, _CMP_ORD_Q));
+            _mm256_storeu_ps(dest + k, values);
+        }
+        return k;
+    }
+#endif
+
+    template<typename T>
+    static inline int copyRowWide(const float *, int, T *) {
+        return 0;
+    }
+
+    /**
+     * Converts a row of values without changing their order.
+     */
+    template<typename T>
+    static void copyRow(const float * src, int count, T * dest) {
+        int k = copyRowWide(src, count, dest);
+        
+#ifdef __SSE2__
+        for (; k + 4 <= count; k += 4) {
+            v4sf values = _mm_loadu_ps(src + k);
+            values = _mm_and_ps(values, _mm_cmpord_ps(values, values));
+            store4(values, dest + k);
+        }
+#endif
+        
+        for (; k < count; k++) {
+            convertValue(src[k], dest[k]);
+        }
+    }
+
+    template<typename T>
+    static void imageToInterleaved(const cv::Mat & image, T * dest) {
+        const int rowSize = 3 * image.cols;
+        for (int i = 0; i < image.rows; i++) {
+            copyRow(image.ptr<float>(i), rowSize, dest + i * rowSize);
+        }
+    }
+
+    void interleavedToPlanar(const cv::Mat & image, float * dest) {
+        imageToPlanar(image, dest);
+    }
+
+    void interleavedToPlanar(const cv::Mat & image, float16 * dest) {
+        imageToPlanar(image, dest);
+    }
+
+    void interleavedToPlanar(const cv::Mat & image, uchar * dest) {
+        imageToPlanar(image, dest);
+    }
+
+    void copyInterleaved(const cv::Mat & image, float * dest) {
+        imageToInterleaved(image, dest);
+    }
+
+    void copyInterleaved(const cv::Mat & image, float16 * dest) {
+        imageToInterleaved(image, dest);
+    }
+
+    void copyInterleaved(const cv::Mat & image, uchar * dest) {
+        imageToInterleaved(image, dest);
+    }
+
+} // namespace chianti
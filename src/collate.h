@@ -0,0 +1,80 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+#ifndef CHIANTI_COLLATE_H
+#define CHIANTI_COLLATE_H
+
+#include <opencv2/opencv.hpp>
+
+#include "chianti/types.h"
+
+namespace chianti {
+
+    /**
+     * Writes an interleaved 3-channel float image (CV_32FC3) to three 
+     * consecutive planes starting at dest. NaN values are replaced by 0. The
+     * image is read exactly once.
+     * 
+     * @param image The interleaved source image.
+     * @param dest The first plane. Each plane holds rows * cols values.
+     */
+    void interleavedToPlanar(const cv::Mat & image, float * dest);
+    
+    /**
+     * Writes an interleaved 3-channel float image (CV_32FC3) to three 
+     * consecutive half precision planes starting at dest. NaN values are 
+     * replaced by 0.
+     * 
+     * @param image The interleaved source image.
+     * @param dest The first plane. Each plane holds rows * cols values.
+     */
+    void interleavedToPlanar(const cv::Mat & image, float16 * dest);
+    
+    /**
+     * Writes an interleaved 3-channel float image (CV_32FC3) with values in
+     * [0, 1] to three consecutive 8-bit planes with values in [0, 255]. NaN
+     * values are replaced by 0.
+     * 
+     * @param image The interleaved source image.
+     * @param dest The first plane. Each plane holds rows * cols values.
+     */
+    void interleavedToPlanar(const cv::Mat & image, uchar * dest);
+    
+    /**
+     * Copies an interleaved 3-channel float image (CV_32FC3) to dest while 
+     * keeping the channels interleaved (channels last). NaN values are 
+     * replaced by 0.
+     * 
+     * @param image The interleaved source image.
+     * @param dest The destination. It holds rows * cols * 3 values.
+     */
+    void copyInterleaved(const cv::Mat & image, float * dest);
+    
+    /**
+     * Converts an interleaved 3-channel float image (CV_32FC3) to half 
+     * precision while keeping the channels interleaved. NaN values are 
+     * replaced by 0.
+     * 
+     * @param image The interleaved source image.
+     * @param dest The destination. It holds rows * cols * 3 values.
+     */
+    void copyInterleaved(const cv::Mat & image, float16 * dest);
+    
+    /**
+     * Converts an interleaved 3-channel float image (CV_32FC3) with values in
+     * [0, 1] to 8-bit values in [0, 255] while keeping the channels 
+     * interleaved. NaN values are replaced by 0.
+     * 
+     * @param image The interleaved source image.
+     * @param dest The destination. It holds rows * cols * 3 values.
+     */
+    void copyInterleaved(const cv::Mat & image, uchar * dest);
+
+} // namespace chianti
+
+#endif
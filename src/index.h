@@ -0,0 +1,88 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+#ifndef CHIANTI_INDEX_H
+#define CHIANTI_INDEX_H
+
+#include <algorithm>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+namespace chianti {
+
+    /**
+     * Writes a value to a binary index file in the byte order of the 
+     * machine.
+     * 
+     * @param stream The stream to write to.
+     * @param value The value.
+     */
+    template <class T>
+    inline void writeIndexValue(std::ostream & stream, T value) {
+        stream.write(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    /**
+     * Writes a length-prefixed string to a binary index file.
+     * 
+     * @param stream The stream to write to.
+     * @param value The string.
+     */
+    inline void writeIndexString(
+            std::ostream & stream, 
+            const std::string & value) {
+        writeIndexValue(stream, static_cast<uint32_t>(value.size()));
+        stream.write(value.data(), value.size());
+    }
+
+    /**
+     * Reads a value from a binary index file and throws if the file ends.
+     * 
+     * @param stream The stream to read from.
+     * @return The value.
+     */
+    template <class T>
+    inline T readIndexValue(std::istream & stream) {
+        T value;
+        stream.read(reinterpret_cast<char *>(&value), sizeof(T));
+        if (!stream) {
+            throw std::runtime_error("The index is truncated.");
+        }
+        return value;
+    }
+
+    /**
+     * Reads a length-prefixed string from a binary index file. The string is
+     * read in chunks, so a corrupt length cannot allocate more memory than 
+     * the file holds.
+     * 
+     * @param stream The stream to read from.
+     * @return The string.
+     */
+    inline std::string readIndexString(std::istream & stream) {
+        const uint32_t size = readIndexValue<uint32_t>(stream);
+        std::string value;
+        char chunk[4096];
+        while (value.size() < size) {
+            const size_t count = std::min<size_t>(
+                    sizeof(chunk), size - value.size());
+            stream.read(chunk, count);
+            if (!stream) {
+                throw std::runtime_error("The index is truncated.");
+            }
+            value.append(chunk, count);
+        }
+        return value;
+    }
+
+} // namespace chianti
+
+#endif
@@ -8,8 +8,12 @@
 
 #include "chianti/loaders.h"
 
+#include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <exception>
 #include <sstream>
+#include <utility>
 
 namespace chianti {
 
@@ -27,9 +31,230 @@ namespace chianti {
         return result;
     }
 
+    /**
+     * Returns true if the filename has a JPEG extension.
+     * 
+     * @param filename The filename.
+     * @return True for .jpg and .jpeg files.
+     */
+    static bool isJpeg(const std::string & filename) {
+        const auto dot = filename.find_last_of('.');
+        if (dot == std::string::npos) {
+            return false;
+        }
+        std::string extension = filename.substr(dot + 1);
+        std::transform(extension.begin(), extension.end(), extension.begin(), 
+                ::tolower);
+        return extension == "jpg" || extension == "jpeg";
+    }
+
+    /**
+     * Returns true if the buffer starts with the JPEG start of image marker.
+     * 
+     * @param buffer The encoded image.
+     * @return True for JPEG images.
+     */
+    static bool isJpeg(const std::vector<uchar> & buffer) {
+        return buffer.size() >= 2 && buffer[0] == 0xFF && buffer[1] == 0xD8;
+    }
+
+    /**
+     * Reads the size of a JPEG image from its frame header without decoding
+     * the image.
+     * 
+     * @param read Reads a number of bytes at an offset and returns false if 
+     *             the image ends before.
+     * @param size Set to the size of the image.
+     * @return True if the size was found.
+     */
+    template <class Reader>
+    static bool readJpegSize(const Reader & read, cv::Size & size) {
+        uchar bytes[5];
+        if (!read(0, bytes, 2) || bytes[0] != 0xFF || bytes[1] != 0xD8) {
+            return false;
+        }
+
+        size_t offset = 2;
+        while (true) {
+            if (!read(offset, bytes, 2) || bytes[0] != 0xFF) {
+                return false;
+            }
+            const uchar marker = bytes[1];
+            if (marker == 0xFF) {
+                // Fill byte
+                offset++;
+                continue;
+            }
+            offset += 2;
+
+            // Markers without a segment
+            if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+                continue;
+            }
+            // The image data starts before the frame header
+            if (marker == 0xD9 || marker == 0xDA) {
+                return false;
+            }
+
+            if (!read(offset, bytes, 2)) {
+                return false;
+            }
+            const size_t length = (bytes[0] << 8) | bytes[1];
+            if (length < 2) {
+                return false;
+            }
+
+            // Start of frame markers, except DHT, JPG and DAC
+            if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && 
+                    marker != 0xC8 && marker != 0xCC) {
+                if (length < 7 || !read(offset + 2, bytes, 5)) {
+                    return false;
+                }
+                size.height = (bytes[1] << 8) | bytes[2];
+                size.width = (bytes[3] << 8) | bytes[4];
+                return size.width > 0 && size.height > 0;
+            }
+            offset += length;
+        }
+    }
+
+    /**
+     * Reads the header of a JPEG image in memory.
+     */
+    class BufferHeaderReader {
+    public:
+        explicit BufferHeaderReader(const std::vector<uchar> & _buffer) : 
+        buffer(_buffer) {
+        }
+
+        bool operator()(size_t offset, uchar * dest, size_t count) const {
+            if (offset > buffer.size() || count > buffer.size() - offset) {
+                return false;
+            }
+            std::memcpy(dest, buffer.data() + offset, count);
+            return true;
+        }
+
+    private:
+        const std::vector<uchar> & buffer;
+    };
+
+    /**
+     * Returns the flags that make the decoder scale the image down.
+     * 
+     * @param color True if the image shall be decoded as color image.
+     * @param factor The downscaling factor.
+     * @return The flags or -1 if the factor is not supported.
+     */
+    static int reducedFlags(bool color, int factor) {
+#if CV_VERSION_MAJOR > 3 || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR >= 2)
+        switch (factor) {
+            case 2:
+                return color ? 
+                        cv::IMREAD_REDUCED_COLOR_2 : 
+                        cv::IMREAD_REDUCED_GRAYSCALE_2;
+            case 4:
+                return color ? 
+                        cv::IMREAD_REDUCED_COLOR_4 : 
+                        cv::IMREAD_REDUCED_GRAYSCALE_4;
+            case 8:
+                return color ? 
+                        cv::IMREAD_REDUCED_COLOR_8 : 
+                        cv::IMREAD_REDUCED_GRAYSCALE_8;
+            default:
+                return -1;
+        }
+#else
+        // The decoder cannot scale before OpenCV 3.2
+        return -1;
+#endif
+    }
+
+    cv::Mat BaseLoader::_loadReduced(
+            const std::string& filename, 
+            bool color, 
+            int factor, 
+            cv::Size& size) const {
+        // Other formats are decoded at full resolution and resized by OpenCV,
+        // which is no faster than subsampling afterwards
+        if (!isJpeg(filename) || reducedFlags(color, factor) < 0) {
+            return cv::Mat();
+        }
+
+        // The file is read once for both the header and the decoder
+        std::vector<uchar> buffer;
+        FileByteSource::readFile(filename, buffer);
+        return _decodeReduced(buffer, filename, color, factor, size);
+    }
+
+    cv::Mat BaseLoader::_decode(
+            const std::vector<uchar>& buffer, 
+            const std::string& name, 
+            bool color) const {
+        cv::Mat result = cv::imdecode(buffer, color);
+        if (!result.data) {
+            std::stringstream error;
+            error << "Could not decode image '" << name << "'.";
+            throw std::runtime_error(error.str());
+        }
+        return result;
+    }
+
+    cv::Mat BaseLoader::_decodeReduced(
+            const std::vector<uchar>& buffer, 
+            const std::string& name, 
+            bool color, 
+            int factor, 
+            cv::Size& size) const {
+        const int flags = reducedFlags(color, factor);
+        if (!isJpeg(buffer) || flags < 0 || 
+                !readJpegSize(BufferHeaderReader(buffer), size)) {
+            return cv::Mat();
+        }
+
+        cv::Mat result = cv::imdecode(buffer, flags);
+        if (!result.data) {
+            std::stringstream error;
+            error << "Could not decode image '" << name << "'.";
+            throw std::runtime_error(error.str());
+        }
+        return result;
+    }
+
     cv::Mat RGBLoader::load(const std::string& filename) const {
-        cv::Mat image = _load(filename, true);
+        return convert(_load(filename, true));
+    }
 
+    cv::Mat RGBLoader::loadReduced(
+            const std::string& filename, 
+            int factor, 
+            cv::Size& size) const {
+        cv::Mat image = _loadReduced(filename, true, factor, size);
+        if (image.empty()) {
+            return image;
+        }
+        return convert(image);
+    }
+
+    cv::Mat RGBLoader::decode(
+            const std::vector<uchar>& buffer, 
+            const std::string& name) const {
+        return convert(_decode(buffer, name, true));
+    }
+
+    cv::Mat RGBLoader::decodeReduced(
+            const std::vector<uchar>& buffer, 
+            const std::string& name, 
+            int factor, 
+            cv::Size& size) const {
+        cv::Mat image = _decodeReduced(buffer, name, true, factor, size);
+        if (image.empty()) {
+            return image;
+        }
+        return convert(image);
+    }
+
+    cv::Mat RGBLoader::convert(const cv::Mat& image) {
         // Convert image to [0, 1] floating point
         cv::Mat result;
         image.convertTo(result, CV_32FC3);
@@ -45,10 +270,23 @@ namespace chianti {
         return _load(filename, false);
     }
 
+    cv::Mat LabelLoader::decode(
+            const std::vector<uchar>& buffer, 
+            const std::string& name) const {
+        return _decode(buffer, name, false);
+    }
+
     cv::Mat ValueMapperLoader::load(const std::string& filename) const {
-        // Load the image
-        cv::Mat result = _load(filename, false);
+        return map(_load(filename, false));
+    }
 
+    cv::Mat ValueMapperLoader::decode(
+            const std::vector<uchar>& buffer, 
+            const std::string& name) const {
+        return map(_decode(buffer, name, false));
+    }
+
+    cv::Mat ValueMapperLoader::map(cv::Mat result) const {
         // Map the values
         for (int i = 0; i < result.rows; i++) {
             for (int j = 0; j < result.cols; j++) {
@@ -59,9 +297,29 @@ namespace chianti {
         return result;
     }
 
+    std::string ValueMapperLoader::getDescription() const {
+        std::stringstream description;
+        description << "ValueMapperLoader(";
+        for (size_t i = 0; i < valueMap.size(); i++) {
+            description << (i > 0 ? " " : "") << static_cast<int>(valueMap[i]);
+        }
+        description << ")";
+        return description.str();
+    }
+
     cv::Mat ColorMapperLoader::load(const std::string& filename) const {
-        // Load the image
-        cv::Mat image = _load(filename, true);
+        return map(_load(filename, true), filename);
+    }
+
+    cv::Mat ColorMapperLoader::decode(
+            const std::vector<uchar>& buffer, 
+            const std::string& name) const {
+        return map(_decode(buffer, name, true), name);
+    }
+
+    cv::Mat ColorMapperLoader::map(
+            const cv::Mat& image, 
+            const std::string& name) const {
         cv::Mat result(image.rows, image.cols, CV_8UC1);
 
         // Map the colors
@@ -73,7 +331,7 @@ namespace chianti {
                 if (colorMap.find(value) == colorMap.end()) {
                     std::stringstream error;
                     error << "Unknown color (" << value[0] << ", " << value[1]
-                            << ", " << value[2] << ") in image '" << filename
+                            << ", " << value[2] << ") in image '" << name
                             << "'.";
                     throw std::runtime_error(error.str());
                 }
@@ -85,13 +343,191 @@ namespace chianti {
         return result;
     }
 
+    std::string ColorMapperLoader::getDescription() const {
+        // The order of an unordered map is not stable
+        std::vector<std::pair<int, int>> entries;
+        for (auto i = colorMap.begin(); i != colorMap.end(); i++) {
+            const int color = (i->first[0] << 16) | (i->first[1] << 8) | 
+                    i->first[2];
+            entries.push_back(std::make_pair(color, i->second));
+        }
+        std::sort(entries.begin(), entries.end());
+
+        std::stringstream description;
+        description << "ColorMapperLoader(";
+        for (size_t i = 0; i < entries.size(); i++) {
+            description << (i > 0 ? " " : "") << entries[i].first << ":" 
+                    << entries[i].second;
+        }
+        description << ")";
+        return description.str();
+    }
+
     ImageTargetPair ImageTargetPairLoader::load(
-            IteratorInterface::ElementIterator filenames) const {
-        ImageTargetPair result = {
-            imageLoader->load(filenames->image),
-            targetLoader->load(filenames->target)
-        };
+            IteratorInterface::ElementIterator filenames,
+            int imageReduction) const {
+        if (source != nullptr) {
+            return decode(filenames, imageReduction);
+        }
+
+        ImageTargetPair result;
+        {
+            ScopedStageTimer timer(imageStage);
+            if (imageReduction > 1) {
+                result.image = imageLoader->loadReduced(
+                        filenames->image, imageReduction, 
+                        result.originalImageSize);
+                if (!result.image.empty()) {
+                    result.imageReduction = imageReduction;
+                }
+            }
+            if (result.image.empty()) {
+                result.image = imageLoader->load(filenames->image);
+            }
+        }
+        {
+            ScopedStageTimer timer(targetStage);
+            result.target = targetLoader->load(filenames->target);
+        }
+        return result;
+    }
+
+    ImageTargetPair ImageTargetPairLoader::decode(
+            IteratorInterface::ElementIterator filenames,
+            int imageReduction) const {
+        std::vector<uchar> imageBuffer;
+        std::vector<uchar> targetBuffer;
+        {
+            ScopedStageTimer timer(readStage);
+            source->read(*filenames, imageBuffer, targetBuffer);
+        }
+
+        ImageTargetPair result;
+        {
+            ScopedStageTimer timer(imageStage);
+            if (imageReduction > 1) {
+                result.image = imageLoader->decodeReduced(
+                        imageBuffer, filenames->image, imageReduction, 
+                        result.originalImageSize);
+                if (!result.image.empty()) {
+                    result.imageReduction = imageReduction;
+                }
+            }
+            if (result.image.empty()) {
+                result.image = imageLoader->decode(
+                        imageBuffer, filenames->image);
+            }
+        }
+        {
+            ScopedStageTimer timer(targetStage);
+            result.target = targetLoader->decode(
+                    targetBuffer, filenames->target);
+        }
         return result;
     }
 
+    std::string ImageTargetPairLoader::getDescription() const {
+        return imageLoader->getDescription() + ", " + 
+                targetLoader->getDescription();
+    }
+
+    void ImageTargetPairLoader::instrument(std::shared_ptr<Stats> _stats) {
+        stats = _stats;
+        if (source != nullptr) {
+            readStage = &stats->getStage("load.read");
+        }
+        imageStage = &stats->getStage("load.image");
+        targetStage = &stats->getStage("load.target");
+    }
+
+    /**
+     * Returns a deep copy of a pair.
+     * 
+     * @param pair The pair to copy.
+     * @return The copy.
+     */
+    static ImageTargetPair clonePair(const ImageTargetPair & pair) {
+        ImageTargetPair result(pair.image.clone(), pair.target.clone());
+        result.imageReduction = pair.imageReduction;
+        result.originalImageSize = pair.originalImageSize;
+        return result;
+    }
+
+    ImageTargetPair CachingImageTargetPairLoader::load(
+            IteratorInterface::ElementIterator filenames,
+            int imageReduction) const {
+        const Key key(filenames->image, filenames->target, imageReduction);
+
+        // Cached pairs are never modified, so they can be copied after the 
+        // lock has been released
+        const auto start = std::chrono::steady_clock::now();
+        ImageTargetPair cached;
+        {
+            std::lock_guard<std::mutex> lock(accessMutex);
+            auto entry = index.find(key);
+            if (entry != index.end()) {
+                // Mark the entry as the most recently used one
+                entries.splice(entries.begin(), entries, entry->second);
+                cached = entry->second->pair;
+            }
+        }
+        if (!cached.image.empty()) {
+            hits.fetch_add(1, std::memory_order_relaxed);
+            ImageTargetPair result = clonePair(cached);
+            if (hitStage != nullptr) {
+                hitStage->record(start, std::chrono::steady_clock::now());
+            }
+            return result;
+        }
+
+        // Decode outside of the lock, so the workers load in parallel
+        misses.fetch_add(1, std::memory_order_relaxed);
+        ImageTargetPair result = 
+                ImageTargetPairLoader::load(filenames, imageReduction);
+        const size_t bytes = 
+                result.image.total() * result.image.elemSize() +
+                result.target.total() * result.target.elemSize();
+        if (bytes > budget) {
+            return result;
+        }
+
+        std::lock_guard<std::mutex> lock(accessMutex);
+
+        // Another worker may have loaded the same pair in the meantime
+        if (index.find(key) != index.end()) {
+            return result;
+        }
+
+        Entry entry = {key, clonePair(result), bytes};
+        entries.push_front(entry);
+        index[key] = entries.begin();
+        size += bytes;
+
+        // Evict the least recently used pairs
+        while (size > budget) {
+            size -= entries.back().bytes;
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+        return result;
+    }
+
+    void CachingImageTargetPairLoader::instrument(
+            std::shared_ptr<Stats> _stats) {
+        ImageTargetPairLoader::instrument(_stats);
+        hitStage = &_stats->getStage("load.cache");
+    }
+
+    size_t CachingImageTargetPairLoader::getSize() const {
+        std::lock_guard<std::mutex> lock(accessMutex);
+        return size;
+    }
+
+    void CachingImageTargetPairLoader::clear() {
+        std::lock_guard<std::mutex> lock(accessMutex);
+        entries.clear();
+        index.clear();
+        size = 0;
+    }
+
 } // namespace chianti
\ No newline at end of file
@@ -0,0 +1,249 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+#include "chianti/packs.h"
+
+#include "index.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace chianti {
+
+    /**
+     * Identifies the index file and the version of the format.
+     */
+    static const char kMagic[8] = {'C', 'H', 'P', 'A', 'C', 'K', '0', '1'};
+
+    /**
+     * Returns the path of the index of a pack.
+     * 
+     * @param path The path of the data file.
+     * @return The path of the index.
+     */
+    static std::string indexPath(const std::string & path) {
+        return path + ".index";
+    }
+
+    /**
+     * Reads a block of bytes at the given offset. Concurrent calls do not
+     * interfere, because the position of the file is not used.
+     * 
+     * @param fd The descriptor of the file.
+     * @param data The buffer.
+     * @param size The number of bytes.
+     * @param offset The offset in the file.
+     * @return True if all bytes were read.
+     */
+    static bool readAt(int fd, uchar * data, size_t size, uint64_t offset) {
+        while (size > 0) {
+            const ssize_t count = pread(fd, data, size, 
+                    static_cast<off_t>(offset));
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                return false;
+            }
+            data += count;
+            size -= static_cast<size_t>(count);
+            offset += static_cast<uint64_t>(count);
+        }
+        return true;
+    }
+
+    PackFile::PackFile(const std::string& _path) : 
+    path(_path), 
+    fd(-1) {
+        const std::string index = indexPath(path);
+        std::ifstream stream(index.c_str(), std::ios::binary);
+        if (!stream) {
+            throw std::runtime_error("Could not open '" + index + "'.");
+        }
+
+        char magic[sizeof(kMagic)];
+        stream.read(magic, sizeof(magic));
+        if (!stream || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+            throw std::runtime_error("'" + index + "' is not a pack index.");
+        }
+
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open '" + path + "'.");
+        }
+
+        try {
+            struct stat status;
+            if (fstat(fd, &status) != 0) {
+                throw std::runtime_error("Could not open '" + path + "'.");
+            }
+            const uint64_t size = static_cast<uint64_t>(status.st_size);
+
+            // Read the records and make sure they lie within the data file
+            const uint64_t numPairs = readIndexValue<uint64_t>(stream);
+            for (uint64_t i = 0; i < numPairs; i++) {
+                FilenamePair pair;
+                pair.image = readIndexString(stream);
+                pair.target = readIndexString(stream);
+
+                Record record;
+                record.offset = readIndexValue<uint64_t>(stream);
+                record.imageSize = readIndexValue<uint64_t>(stream);
+                record.targetSize = readIndexValue<uint64_t>(stream);
+                // Check each term, so corrupt values cannot overflow
+                if (record.imageSize > size || 
+                        record.targetSize > size - record.imageSize ||
+                        record.offset > 
+                                size - record.imageSize - record.targetSize) {
+                    throw std::runtime_error("The pack '" + path + 
+                            "' is corrupt.");
+                }
+
+                records[std::make_pair(pair.image, pair.target)] = record;
+                filenames.push_back(pair);
+            }
+        } catch (...) {
+            // The destructor does not run if the constructor throws
+            ::close(fd);
+            throw;
+        }
+    }
+
+    PackFile::~PackFile() {
+        ::close(fd);
+    }
+
+    void PackFile::read(
+            const FilenamePair& pair,
+            std::vector<uchar>& image,
+            std::vector<uchar>& target) const {
+        auto record = records.find(std::make_pair(pair.image, pair.target));
+        if (record == records.end()) {
+            throw std::runtime_error("The pair ('" + pair.image + "', '" + 
+                    pair.target + "') is not in the pack '" + path + "'.");
+        }
+
+        // The target directly follows the image, so both are read at once
+        const Record & r = record->second;
+        image.resize(r.imageSize + r.targetSize);
+        if (!readAt(fd, image.data(), image.size(), r.offset)) {
+            throw std::runtime_error("Could not read '" + path + "'.");
+        }
+        target.assign(image.begin() + r.imageSize, image.end());
+        image.resize(r.imageSize);
+    }
+
+    IteratorInterface::ContainerPtr PackFile::getFilenames() const {
+        return IteratorInterface::ContainerPtr(
+                new std::vector<FilenamePair>(filenames));
+    }
+
+    PackWriter::PackWriter(const std::string& _path) : 
+    path(_path), 
+    file(nullptr), 
+    offset(0) {
+        // A stale index must not describe the new data file
+        std::remove(indexPath(path).c_str());
+
+        file = std::fopen(path.c_str(), "wb");
+        if (file == nullptr) {
+            throw std::runtime_error("Could not create '" + path + "'.");
+        }
+    }
+
+    PackWriter::~PackWriter() {
+        if (file != nullptr) {
+            std::fclose(file);
+        }
+    }
+
+    void PackWriter::add(const FilenamePair& pair) {
+        std::vector<uchar> image;
+        std::vector<uchar> target;
+        FileByteSource().read(pair, image, target);
+        add(pair, image, target);
+    }
+
+    void PackWriter::add(
+            const FilenamePair& pair,
+            const std::vector<uchar>& image,
+            const std::vector<uchar>& target) {
+        if (file == nullptr) {
+            throw std::runtime_error("The pack '" + path + "' is closed.");
+        }
+        const auto key = std::make_pair(pair.image, pair.target);
+        if (added.find(key) != added.end()) {
+            throw std::runtime_error("The pair ('" + pair.image + "', '" + 
+                    pair.target + "') is already in the pack.");
+        }
+
+        if ((!image.empty() && 
+                std::fwrite(image.data(), 1, image.size(), file) != 
+                        image.size()) ||
+                (!target.empty() && 
+                std::fwrite(target.data(), 1, target.size(), file) != 
+                        target.size())) {
+            throw std::runtime_error("Could not write '" + path + "'.");
+        }
+
+        std::array<uint64_t, 3> location = {{
+            offset, 
+            static_cast<uint64_t>(image.size()), 
+            static_cast<uint64_t>(target.size())
+        }};
+        added[key] = filenames.size();
+        filenames.push_back(pair);
+        locations.push_back(location);
+        offset += image.size() + target.size();
+    }
+
+    void PackWriter::close() {
+        if (file == nullptr) {
+            return;
+        }
+        std::FILE * closing = file;
+        file = nullptr;
+        if (std::fclose(closing) != 0) {
+            throw std::runtime_error("Could not write '" + path + "'.");
+        }
+
+        // Write the index last and move it into place, so readers never see
+        // a partial pack
+        const std::string index = indexPath(path);
+        const std::string temporary = index + ".tmp";
+        {
+            std::ofstream stream(temporary.c_str(), std::ios::binary);
+            stream.write(kMagic, sizeof(kMagic));
+            writeIndexValue(stream, static_cast<uint64_t>(filenames.size()));
+            for (size_t i = 0; i < filenames.size(); i++) {
+                writeIndexString(stream, filenames[i].image);
+                writeIndexString(stream, filenames[i].target);
+                for (int k = 0; k < 3; k++) {
+                    writeIndexValue(stream, locations[i][k]);
+                }
+            }
+            stream.close();
+            if (!stream) {
+                throw std::runtime_error(
+                        "Could not write '" + temporary + "'.");
+            }
+        }
+        if (std::rename(temporary.c_str(), index.c_str()) != 0) {
+            throw std::runtime_error("Could not write '" + index + "'.");
+        }
+    }
+
+} // namespace chianti
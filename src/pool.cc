@@ -0,0 +1,50 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+#include "chianti/pool.h"
+
+namespace chianti {
+
+    void BatchRecycler::operator()(Batch* batch) const {
+        std::unique_ptr<Batch> owned(batch);
+        
+        // Return the batch if the pool is still alive
+        auto target = pool.lock();
+        if (target != nullptr) {
+            target->release(std::move(owned));
+        }
+    }
+
+    BatchPtr BatchPool::acquire() {
+        BatchRecycler recycler(shared_from_this());
+        
+        {
+            std::lock_guard<std::mutex> lock(accessMutex);
+            if (!freeBatches.empty()) {
+                auto batch = std::move(freeBatches.back());
+                freeBatches.pop_back();
+                return BatchPtr(batch.release(), recycler);
+            }
+            numAllocated++;
+        }
+        
+        // Allocate a new batch without holding the lock
+        return BatchPtr(new Batch(format), recycler);
+    }
+
+    void BatchPool::release(std::unique_ptr<Batch> batch) {
+        std::lock_guard<std::mutex> lock(accessMutex);
+        freeBatches.push_back(std::move(batch));
+    }
+
+    int BatchPool::getNumAllocated() const {
+        std::lock_guard<std::mutex> lock(accessMutex);
+        return numAllocated;
+    }
+
+} // namespace chianti
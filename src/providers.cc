@@ -7,8 +7,10 @@
  */
 
 #include "chianti/providers.h"
-#include "chianti/memory.h"
 
+#include "collate.h"
+
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include <cstring>
@@ -17,37 +19,368 @@
 
 namespace chianti {
 
-    std::unique_ptr<Batch> DataProvider::next() {
-        // Wait until a new batch is available
+    /**
+     * The number of batches after which the auto-tuner adjusts the workers.
+     */
+    static const int kTuningWindow = 8;
+    /**
+     * The fraction of the time the consumers may wait for batches before more
+     * workers are activated.
+     */
+    static const double kStallTolerance = 0.01;
+    /**
+     * The fraction of the time the workers may wait for room in the queues 
+     * before a worker is deactivated.
+     */
+    static const double kIdleTolerance = 0.5;
+
+    /**
+     * Returns the number of seconds that have passed since the given time.
+     */
+    static double secondsSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+
+    BatchPtr DataProvider::next(int consumer) {
+        if (consumer < 0 || consumer >= numConsumers) {
+            std::stringstream error;
+            error << "Invalid consumer " << consumer << ". The provider has "
+                    << numConsumers << " consumers.";
+            throw std::runtime_error(error.str());
+        }
+
+        // Wait until the oldest batch in the queue has been completed
         std::unique_lock<std::mutex> lock(batchAccessMutex);
-        cv.wait(lock, [this]() {
-            return batch != nullptr;
-        });
+        auto & queue = queues[consumer];
+        auto ready = [&queue]() {
+            return !queue.empty() && 
+                    queue.front()->completed == queue.front()->size;
+        };
+
+        // Sample the number of batches that are ready for the consumer
+        size_t completed = 0;
+        for (auto i = queue.begin(); i != queue.end(); i++) {
+            if ((*i)->completed == (*i)->size) {
+                completed++;
+            }
+        }
+        if (occupancy.size() <= completed) {
+            occupancy.resize(completed + 1, 0);
+        }
+        occupancy[completed]++;
 
-        // Copy the batch 
-        auto result = std::move(batch);
+        // Every call is recorded, so the stage counts the calls to next()
+        const auto start = std::chrono::steady_clock::now();
+        double waited = 0;
+        if (!ready()) {
+            batchAvailable.wait(lock, ready);
+            waited = secondsSince(start);
+        }
+        batchWaitStage->record(start, std::chrono::steady_clock::now());
+
+        auto pending = queue.front();
+        queue.pop_front();
 
-        // Compute the next batch
-        batch = nullptr;
+        if (autotune) {
+            tune(waited);
+        }
 
+        // Tell the workers that there is room for another batch
         lock.unlock();
-        cv.notify_one();
+        slotAvailable.notify_all();
 
-        return result;
+        // Forward errors that occurred on the worker threads
+        if (pending->error) {
+            std::rethrow_exception(pending->error);
+        }
+
+        auto batch = std::move(pending->batch);
+        batch->size = pending->size;
+        batch->epoch = pending->epoch;
+        return batch;
+    }
+
+    QueueMetrics DataProvider::getQueueMetrics() const {
+        QueueMetrics metrics = {0, 0, 0, std::vector<uint64_t>(), 0};
+        if (!initialized) {
+            return metrics;
+        }
+
+        const auto stall = batchWaitStage->summarize();
+        metrics.numCalls = stall.count;
+        metrics.stallSeconds = stall.totalSeconds;
+        metrics.producerWaitSeconds = slotWaitStage->summarize().totalSeconds;
+
+        std::lock_guard<std::mutex> lock(batchAccessMutex);
+        metrics.occupancy = occupancy;
+        metrics.numDroppedSamples = droppedSamples;
+        return metrics;
+    }
+
+    void DataProvider::clearStats() {
+        stats->clear();
+        std::lock_guard<std::mutex> lock(batchAccessMutex);
+        occupancy.clear();
+        droppedSamples = 0;
     }
 
     void DataProvider::init() {
+        // The workers divide by the number of samples per epoch
+        if (iterator->getNumElements() == 0) {
+            throw std::runtime_error("The iterator does not contain any "
+                    "samples.");
+        }
+
+        // Register the pipeline stages in the order in which they run
+        iteratorStage = &stats->getStage("iterator.next");
+        loader->instrument(stats);
+        if (augmentor != nullptr) {
+            augmentStage = &stats->getStage("augment");
+            augmentor->instrument(stats, "augment.");
+        }
+        encodeStage = &stats->getStage("encode");
+        collateStage = &stats->getStage("collate");
+        slotWaitStage = &stats->getStage("wait.slot");
+        storageWaitStage = &stats->getStage("wait.storage");
+        batchWaitStage = &stats->getStage("wait.batch");
+
+        // Let the decoder take over a leading subsampling step
+        if (reducedDecoding && augmentor != nullptr) {
+            decodeReduction = augmentor->getDecodeReduction();
+        }
+
         // Load an image/target pair in order to get the size of the images
-        auto pair = load(iterator->next());
+        auto pair = load(iterator->next(), 0);
 
         // Make sure that next() corresponds to the ordering of iterator
         iterator->reset();
+        // The probe sample is not part of the data
+        stats->clear();
+
+        if (!bucketing && !partialBatches && 
+                iterator->getNumElements() < static_cast<size_t>(batchSize)) {
+            throw std::runtime_error("The dataset is smaller than the batch "
+                    "size. Enable partial batches in order to use it.");
+        }
 
         imageSize = {pair.image.rows, pair.image.cols};
         targetSize = {pair.target.rows, pair.target.cols};
+        queues.resize(numConsumers);
+
+        activeWorkers = autotune ? minWorkers : numWorkers;
+        windowStart = std::chrono::steady_clock::now();
+
+        // Launch the worker threads
+        initialized = true;
+        for (int i = 0; i < numWorkers; i++) {
+            workers.push_back(std::thread(bucketing ? 
+                    &DataProvider::workBucketed : &DataProvider::work, 
+                    this, i));
+        }
+    }
 
-        // Launch the prefill thread
-        prefillThread = std::thread(&DataProvider::loadBatch, this);
+    void DataProvider::reset() {
+        // Claims advance the iterator and the sample counter together, so both
+        // are reset under the same lock
+        {
+            std::lock_guard<std::mutex> lock(batchAccessMutex);
+            iterator->reset();
+            sampleCounter = 0;
+
+            // Discard the batches of the old sequence. Workers that are still
+            // filling them hold a reference and return them to the pool once
+            // they are done.
+            for (auto i = queues.begin(); i != queues.end(); i++) {
+                i->clear();
+            }
+            openBatch = nullptr;
+            nextConsumer = 0;
+
+            // Samples that are claimed before this point are dropped
+            buckets.clear();
+            placedSamples.clear();
+            generation++;
+        }
+        slotAvailable.notify_all();
+    }
+
+    int DataProvider::getNumBatches() const {
+        if (bucketing) {
+            // Depends on the sizes of the samples
+            return -1;
+        }
+        
+        const int numElements = static_cast<int>(iterator->getNumElements());
+        if (partialBatches) {
+            return (numElements + batchSize - 1) / batchSize;
+        }
+        return numElements / batchSize;
+    }
+
+    void DataProvider::setBucketing(bool _bucketing) {
+        assertNotInitialized();
+        bucketing = _bucketing;
+    }
+
+    void DataProvider::setMaxOpenBuckets(int buckets) {
+        assertNotInitialized();
+        if (buckets < 1) {
+            throw std::runtime_error("There must be at least one open "
+                    "bucket.");
+        }
+        maxOpenBuckets = buckets;
+    }
+
+    void DataProvider::setReducedDecoding(bool enabled) {
+        assertNotInitialized();
+        reducedDecoding = enabled;
+    }
+
+    void DataProvider::setPartialBatches(bool partial) {
+        assertNotInitialized();
+        partialBatches = partial;
+    }
+
+    void DataProvider::setSeed(unsigned int _seed) {
+        assertNotInitialized();
+        seed = _seed;
+        deterministic = true;
+    }
+
+    void DataProvider::setPrefetchDepth(int depth) {
+        assertNotInitialized();
+        if (depth < 1) {
+            throw std::runtime_error("Prefetch depth must be at least 1.");
+        }
+        prefetchDepth = depth;
+    }
+
+    int DataProvider::getPrefetchDepth() const {
+        std::lock_guard<std::mutex> lock(batchAccessMutex);
+        return prefetchDepth;
+    }
+
+    void DataProvider::enableAutotune(
+            int _minWorkers, 
+            int _maxWorkers, 
+            int minDepth, 
+            int maxDepth) {
+        assertNotInitialized();
+        if (_minWorkers < 1 || _maxWorkers < _minWorkers) {
+            throw std::runtime_error("Invalid bounds for the number of "
+                    "workers.");
+        }
+        if (minDepth < 1 || maxDepth < minDepth) {
+            throw std::runtime_error("Invalid bounds for the prefetch depth.");
+        }
+        autotune = true;
+        minWorkers = _minWorkers;
+        numWorkers = _maxWorkers;
+        minPrefetchDepth = minDepth;
+        maxPrefetchDepth = maxDepth;
+        prefetchDepth = minDepth;
+    }
+
+    int DataProvider::getNumActiveWorkers() const {
+        std::lock_guard<std::mutex> lock(batchAccessMutex);
+        return activeWorkers;
+    }
+
+    void DataProvider::tune(double consumerWait) {
+        windowConsumerWait += consumerWait;
+        if (++windowBatches < kTuningWindow) {
+            return;
+        }
+
+        const double elapsed = secondsSince(windowStart);
+        if (windowConsumerWait > kStallTolerance * elapsed) {
+            // The consumers are starved. Activate workers quickly and deepen
+            // the queues once all workers are active.
+            if (activeWorkers < numWorkers) {
+                activeWorkers = std::min(numWorkers, 
+                        activeWorkers + std::max(1, activeWorkers / 2));
+            } else if (prefetchDepth < maxPrefetchDepth) {
+                prefetchDepth++;
+            }
+        } else if (windowProducerWait > 
+                kIdleTolerance * elapsed * activeWorkers && 
+                activeWorkers > minWorkers) {
+            // The workers mostly wait for the consumers. Give one core at a 
+            // time back to the consumer.
+            activeWorkers--;
+        }
+
+        windowBatches = 0;
+        windowStart = std::chrono::steady_clock::now();
+        windowConsumerWait = 0;
+        windowProducerWait = 0;
+    }
+
+    bool DataProvider::waitForSlot(
+            std::unique_lock<std::mutex> & lock, 
+            int index) {
+        while (!terminateThread) {
+            if (index >= activeWorkers) {
+                // Parked by the auto-tuner
+                slotAvailable.wait(lock);
+            } else if (hasOpenSlot()) {
+                return true;
+            } else {
+                // The queues are full
+                ScopedStageTimer timer(slotWaitStage);
+                const auto start = std::chrono::steady_clock::now();
+                slotAvailable.wait(lock);
+                if (index < activeWorkers) {
+                    windowProducerWait += secondsSince(start);
+                }
+            }
+        }
+        return false;
+    }
+
+    void DataProvider::setLayout(Layout _layout) {
+        assertNotInitialized();
+        layout = _layout;
+    }
+
+    void DataProvider::setImageFormat(ImageFormat format) {
+        assertNotInitialized();
+        imageFormat = format;
+    }
+
+    void DataProvider::setTargetFormat(TargetFormat format) {
+        assertNotInitialized();
+        targetFormat = format;
+    }
+
+    void DataProvider::setNumWorkers(int workers) {
+        assertNotInitialized();
+        if (workers < 1) {
+            throw std::runtime_error("There must be at least one worker.");
+        }
+        numWorkers = workers;
+    }
+
+    void DataProvider::setNumConsumers(int consumers) {
+        assertNotInitialized();
+        if (consumers < 1) {
+            throw std::runtime_error("There must be at least one consumer.");
+        }
+        numConsumers = consumers;
+    }
+
+    int DataProvider::defaultNumWorkers() {
+        // hardware_concurrency() returns 0 if the value is not computable
+        return std::max(1, static_cast<int>(
+                std::thread::hardware_concurrency()));
+    }
+
+    void DataProvider::assertNotInitialized() const {
+        if (initialized) {
+            throw std::runtime_error("The provider has already been "
+                    "initialized.");
+        }
     }
 
     void DataProvider::assertSize(const cv::Mat& img,
@@ -70,115 +403,475 @@ namespace chianti {
         }
     }
 
-    static void filterNans(ImageTargetPair & pair) {
-        // Replace Nan values by 0
-        auto data = reinterpret_cast<float*>(pair.image.data);
-        const auto size = 3 * pair.image.total();
-        
-        for (size_t i = 0; i < size; i++) {
-            if (std::isnan(data[i])) {
-                data[i] = 0.0f;
-            }
-        }
-    }
-    
     ImageTargetPair DataProvider::load(
-            IteratorInterface::ElementIterator filenames) {
-        auto result = loader->load(filenames);
+            IteratorInterface::ElementIterator filenames,
+            size_t sample) {
+        auto result = loader->load(filenames, decodeReduction);
         if (augmentor != nullptr) {
-            augmentor->augment(result);
+            ScopedStageTimer timer(augmentStage);
+            if (deterministic) {
+                const size_t epochSize = std::max<size_t>(
+                        1, iterator->getNumElements());
+                auto engine = makeSampleEngine(
+                        seed,
+                        static_cast<unsigned int>(sample / epochSize),
+                        static_cast<unsigned int>(sample % epochSize));
+                augmentor->augment(result, engine);
+            } else {
+                augmentor->augment(result);
+            }
         }
         
-        // Remove NaN
-        filterNans(result);
-        
         return result;
     }
 
     void DataProvider::encode_onehot(
             const cv::Mat & target, 
             Tensor<float, 4> & tensor, 
-            int offset) {
-        const auto imgSize = target.rows * target.cols;
+            std::size_t offset) {
+        const std::size_t imgSize = 
+                static_cast<std::size_t>(target.rows) * target.cols;
         for (int i = 0; i < target.rows; i++) {
             for (int j = 0; j < target.cols; j++) {
-                const auto val = static_cast<int>(target.at<uchar>(i, j));
+                const auto val = static_cast<std::size_t>(
+                        target.at<uchar>(i, j));
                 if (val != 255) {
-                    int index = offset + val * imgSize + i * target.cols + j;
+                    const std::size_t pixel = 
+                            static_cast<std::size_t>(i) * target.cols + j;
+                    const std::size_t index = layout == Layout::NHWC ? 
+                            offset + pixel * numClasses + val :
+                            offset + val * imgSize + pixel;
                     tensor.data[index] = 1.0f;
                 }
             }
         }
     }
     
-    void DataProvider::loadBatch() {
-        while (!terminateThread) {
-            // Wait until a new batch must be computed
-            std::unique_lock<std::mutex> lock(batchAccessMutex);
-            cv.wait(lock, [this]() {
-                return batch == nullptr;
-            });
-
-            batch = make_unique<Batch>(
-                std::array<int, 4>{batchSize, 3, imageSize[0], imageSize[1]},
-                std::array<int, 4>{batchSize, numClasses, targetSize[0], 
-                        targetSize[1]});
-            batch->targets.fill(0.0f);
-            
-            const int imageOffset = 3 * imageSize[0] * imageSize[1];
-            const int targetOffset = numClasses * targetSize[0] * targetSize[1];
-
-#pragma omp parallel for
-            for (int i = 0; i < batchSize; i++) {
-                // Load the image/label pair
-                auto pair = load(iterator->next());
-
-                // Make sure all images are of the right size and type
-                assertSize(pair.image, imageSize);
-                assertSize(pair.target, targetSize);
-                assertType(pair.image, CV_32FC3);
-                assertType(pair.target, CV_8UC1);
-
-                // Convert the targets to a one-hot encoding.
-                this->encode_onehot(
-                        pair.target, batch->targets, i * targetOffset);
-
-                // Copy the images to the right destination
-                // While we can use memcpy for the targets, we have to shuffle
-                // The array dimensions for the images
-                cv::Mat rgb[3];
-                cv::split(pair.image, rgb);
-                auto dest = batch->images.data.data();
-                std::memcpy(dest + imageOffset * i,
-                        rgb[0].data,
-                        imageOffset / 3 * sizeof (float));
-                std::memcpy(dest + imageOffset * i + imageOffset / 3,
-                        rgb[1].data,
-                        imageOffset / 3 * sizeof (float));
-                std::memcpy(dest + imageOffset * i + 2 * imageOffset / 3,
-                        rgb[2].data,
-                        imageOffset / 3 * sizeof (float));
-            }
-
-            lock.unlock();
-            cv.notify_one();
+    /**
+     * Copies a label image to a dense label map.
+     */
+    template<typename T>
+    static void copyLabels(const cv::Mat & target, T * dest) {
+        for (int i = 0; i < target.rows; i++) {
+            const auto row = target.ptr<uchar>(i);
+            std::copy(row, row + target.cols, dest + i * target.cols);
         }
     }
+    
+    /**
+     * Writes an interleaved float image to a batch in the given layout.
+     */
+    template<typename T>
+    static void copyImage(const cv::Mat & image, Layout layout, T * dest) {
+        if (layout == Layout::NHWC) {
+            copyInterleaved(image, dest);
+        } else {
+            interleavedToPlanar(image, dest);
+        }
+    }
+    
+    bool DataProvider::hasOpenSlot() const {
+        // Either the open batch still has unclaimed slots or there is room 
+        // for another batch in the queue of the next consumer. In bucketing
+        // mode, batches only enter the queue once they are full, and the 
+        // number of open buckets is bounded when the samples are placed.
+        if (!bucketing && openBatch != nullptr && 
+                openBatch->claimed < openBatch->size) {
+            return true;
+        }
+        return static_cast<int>(queues[nextConsumer].size()) < 
+                prefetchDepth + 1;
+    }
 
-    DataProvider::~DataProvider() {
-        // Terminate the prefill thread
+    void DataProvider::openNextBatch() {
+        const size_t epochSize = iterator->getNumElements();
+        size_t remaining = epochSize - sampleCounter % epochSize;
+
+        // Batches do not span epochs. Skip the samples that do not fill a 
+        // whole batch unless partial batches are allowed.
+        if (!partialBatches && remaining < static_cast<size_t>(batchSize)) {
+            droppedSamples += remaining;
+            for (; remaining > 0; remaining--) {
+                iterator->next();
+                sampleCounter++;
+            }
+            remaining = epochSize;
+        }
+
+        openBatch = std::make_shared<PendingBatch>(
+                static_cast<int>(std::min<size_t>(batchSize, remaining)),
+                static_cast<int>(sampleCounter / epochSize));
+        enqueue(openBatch);
+    }
+
+    void DataProvider::fillSlot(
+            IteratorInterface::ElementIterator filenames,
+            size_t sample,
+            Batch & batch,
+            int slot) {
+        // Load the image/label pair
+        auto pair = load(filenames, sample);
+
+        // Make sure all images are of the right size and type
+        assertSize(pair.image, imageSize);
+        assertSize(pair.target, targetSize);
+        assertType(pair.image, CV_32FC3);
+        assertType(pair.target, CV_8UC1);
+
+        storeSample(pair, batch, slot);
+    }
+
+    void DataProvider::storeSample(
+            const ImageTargetPair & pair, 
+            Batch & batch, 
+            int slot) {
+        const auto & format = batch.format;
+        // The offsets of later slots can exceed the range of int
+        const std::size_t imageOffset = 3 * 
+                static_cast<std::size_t>(format.imageSize[0]) * 
+                format.imageSize[1];
+        const std::size_t labelOffset = 
+                static_cast<std::size_t>(format.targetSize[0]) * 
+                format.targetSize[1];
+        const std::size_t targetOffset = numClasses * labelOffset;
+
+        // Store the targets in the requested encoding
+        {
+            ScopedStageTimer timer(encodeStage);
+            switch (targetFormat) {
+                case TargetFormat::OneHot: {
+                    auto targets = 
+                            batch.targets.data.data() + slot * targetOffset;
+                    std::fill(targets, targets + targetOffset, 0.0f);
+                    this->encode_onehot(
+                            pair.target, batch.targets, slot * targetOffset);
+                    break;
+                }
+                case TargetFormat::UInt8Labels:
+                    copyLabels(pair.target, 
+                            batch.labels.data.data() + slot * labelOffset);
+                    break;
+                case TargetFormat::Int32Labels:
+                    copyLabels(pair.target, batch.wideLabels.data.data() + 
+                            slot * labelOffset);
+                    break;
+            }
+        }
+
+        // Bring the images into the requested layout, replace NaN values and
+        // convert them to the output precision in a single pass
+        ScopedStageTimer timer(collateStage);
+        switch (imageFormat) {
+            case ImageFormat::Float32:
+                copyImage(pair.image, layout,
+                        batch.images.data.data() + imageOffset * slot);
+                break;
+            case ImageFormat::Float16:
+                copyImage(pair.image, layout,
+                        batch.halfImages.data.data() + imageOffset * slot);
+                break;
+            case ImageFormat::UInt8:
+                copyImage(pair.image, layout,
+                        batch.byteImages.data.data() + imageOffset * slot);
+                break;
+        }
+    }
+
+    BatchFormat DataProvider::makeFormat(
+            const std::array<int, 2> & _imageSize,
+            const std::array<int, 2> & _targetSize) const {
+        BatchFormat format;
+        format.batchSize = batchSize;
+        format.numClasses = numClasses;
+        format.imageSize = _imageSize;
+        format.targetSize = _targetSize;
+        format.layout = layout;
+        format.imageFormat = imageFormat;
+        format.targetFormat = targetFormat;
+        return format;
+    }
+
+    std::shared_ptr<BatchPool> DataProvider::getPool(
+            const std::array<int, 2> & _imageSize,
+            const std::array<int, 2> & _targetSize) {
+        const std::array<int, 4> key = {{
+            _imageSize[0], _imageSize[1], _targetSize[0], _targetSize[1]
+        }};
+        auto & pool = pools[key];
+        if (pool == nullptr) {
+            pool = std::make_shared<BatchPool>(
+                    makeFormat(_imageSize, _targetSize));
+        }
+        return pool;
+    }
+
+    void DataProvider::enqueue(std::shared_ptr<PendingBatch> pending) {
+        // Deal the batches to the consumers in round-robin order
+        queues[nextConsumer].push_back(std::move(pending));
+        nextConsumer = (nextConsumer + 1) % numConsumers;
+    }
+
+    void DataProvider::provideStorage(
+            PendingBatch & pending, 
+            BatchPool & pool) {
+        // The storage is acquired outside of the lock
+        auto batch = pool.acquire();
+        {
+            std::lock_guard<std::mutex> lock(batchAccessMutex);
+            pending.batch = std::move(batch);
+        }
+        slotAvailable.notify_all();
+    }
+
+    Batch & DataProvider::waitForStorage(PendingBatch & pending) {
+        ScopedStageTimer timer(storageWaitStage);
         std::unique_lock<std::mutex> lock(batchAccessMutex);
-        cv.wait(lock, [this]() {
-            return batch != nullptr;
+        slotAvailable.wait(lock, [&pending]() {
+            return pending.batch != nullptr;
         });
+        return *pending.batch;
+    }
 
-        batch = nullptr;
-        terminateThread = true;
+    void DataProvider::finishSlot(
+            PendingBatch & pending, 
+            std::exception_ptr error) {
+        // Mark the slot as done. Errors are forwarded to the consumer.
+        bool complete;
+        {
+            std::lock_guard<std::mutex> lock(batchAccessMutex);
+            if (error && !pending.error) {
+                pending.error = error;
+            }
+            complete = ++pending.completed == pending.size;
+        }
+        if (complete) {
+            batchAvailable.notify_all();
+        }
+    }
 
-        lock.unlock();
-        cv.notify_one();
+    void DataProvider::work(int index) {
+        while (true) {
+            std::shared_ptr<PendingBatch> pending;
+            std::shared_ptr<BatchPool> pool;
+            IteratorInterface::ElementIterator filenames;
+            std::exception_ptr error;
+            size_t sample;
+            int slot;
+
+            // Claim the next free slot. The iterator is advanced while holding
+            // the lock, so the samples appear in the batches in the order 
+            // given by the iterator.
+            {
+                std::unique_lock<std::mutex> lock(batchAccessMutex);
+                if (!waitForSlot(lock, index)) {
+                    return;
+                }
 
-        prefillThread.join();
+                if (openBatch == nullptr || 
+                        openBatch->claimed == openBatch->size) {
+                    openNextBatch();
+                    pool = getPool(imageSize, targetSize);
+                }
+
+                pending = openBatch;
+                slot = pending->claimed++;
+                sample = sampleCounter++;
+                
+                try {
+                    ScopedStageTimer timer(iteratorStage);
+                    filenames = iterator->next();
+                } catch (...) {
+                    error = std::current_exception();
+                }
+            }
+
+            // The worker that opened the batch provides its storage. All 
+            // other workers wait for it before writing.
+            if (pool != nullptr) {
+                provideStorage(*pending, *pool);
+            }
+
+            if (!error) {
+                ScopedTraceLabel label(filenames->image);
+                try {
+                    fillSlot(filenames, sample, waitForStorage(*pending), slot);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+            }
+
+            finishSlot(*pending, error);
+        }
+    }
+
+    bool DataProvider::flushEpoch(int epoch) {
+        // All samples of the epoch have been placed, so its remaining buckets
+        // will not fill up anymore
+        bool flushed = false;
+        placedSamples.erase(epoch);
+        for (auto i = buckets.begin(); i != buckets.end();) {
+            if (i->first[0] != epoch) {
+                i++;
+                continue;
+            }
+            flushed = closeBucket(i++) || flushed;
+        }
+        return flushed;
+    }
+
+    bool DataProvider::closeBucket(std::map<std::array<int, 5>, 
+            std::shared_ptr<PendingBatch>>::iterator bucket) {
+        // Workers that still fill a discarded batch hold a reference and 
+        // return its storage to the pool once they are done
+        const auto pending = bucket->second;
+        buckets.erase(bucket);
+        if (!partialBatches) {
+            droppedSamples += pending->claimed;
+            return false;
+        }
+        pending->size = pending->claimed;
+        enqueue(pending);
+        return true;
+    }
+
+    void DataProvider::workBucketed(int index) {
+        const size_t epochSize = iterator->getNumElements();
+
+        while (true) {
+            IteratorInterface::ElementIterator filenames;
+            std::exception_ptr error;
+            size_t sample;
+            int claimedGeneration;
+
+            // Claim the next sample
+            {
+                std::unique_lock<std::mutex> lock(batchAccessMutex);
+                if (!waitForSlot(lock, index)) {
+                    return;
+                }
+
+                claimedGeneration = generation;
+                sample = sampleCounter++;
+
+                try {
+                    ScopedStageTimer timer(iteratorStage);
+                    filenames = iterator->next();
+                } catch (...) {
+                    error = std::current_exception();
+                }
+            }
+
+            // The bucket is only known once the sample has been loaded
+            ImageTargetPair pair;
+            if (!error) {
+                ScopedTraceLabel label(filenames->image);
+                try {
+                    pair = load(filenames, sample);
+                    assertType(pair.image, CV_32FC3);
+                    assertType(pair.target, CV_8UC1);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+            }
+
+            // Place the sample in the open batch of its bucket
+            const int epoch = static_cast<int>(sample / epochSize);
+            std::shared_ptr<PendingBatch> pending;
+            std::shared_ptr<BatchPool> pool;
+            int slot = 0;
+            bool notify = false;
+            {
+                std::lock_guard<std::mutex> lock(batchAccessMutex);
+
+                // Drop samples that were claimed before the last reset
+                if (claimedGeneration != generation) {
+                    continue;
+                }
+
+                if (error) {
+                    // Forward the error to the consumer in a batch of its own
+                    auto failed = std::make_shared<PendingBatch>(0, epoch);
+                    failed->error = error;
+                    enqueue(failed);
+                    notify = true;
+                } else {
+                    const std::array<int, 5> key = {{
+                        epoch, 
+                        pair.image.rows, pair.image.cols, 
+                        pair.target.rows, pair.target.cols
+                    }};
+                    auto bucket = buckets.find(key);
+                    if (bucket == buckets.end() && static_cast<int>(
+                            buckets.size()) >= maxOpenBuckets) {
+                        // Each open bucket holds the storage of a batch, 
+                        // so the fullest one is closed early
+                        auto fullest = buckets.begin();
+                        for (auto i = buckets.begin(); i != buckets.end(); 
+                                i++) {
+                            if (i->second->claimed > 
+                                    fullest->second->claimed) {
+                                fullest = i;
+                            }
+                        }
+                        notify = closeBucket(fullest) || notify;
+                    }
+                    if (bucket == buckets.end()) {
+                        bucket = buckets.insert(std::make_pair(key, 
+                                std::make_shared<PendingBatch>(
+                                batchSize, epoch))).first;
+                        pool = getPool(
+                                {{pair.image.rows, pair.image.cols}},
+                                {{pair.target.rows, pair.target.cols}});
+                    }
+
+                    pending = bucket->second;
+                    slot = pending->claimed++;
+                    if (pending->claimed == batchSize) {
+                        enqueue(pending);
+                        buckets.erase(bucket);
+                    }
+                }
+
+                if (++placedSamples[epoch] == epochSize) {
+                    notify = flushEpoch(epoch) || notify;
+                }
+            }
+
+            if (notify) {
+                batchAvailable.notify_all();
+            }
+            if (error) {
+                continue;
+            }
+
+            // The worker that opened the batch provides its storage
+            if (pool != nullptr) {
+                provideStorage(*pending, *pool);
+            }
+
+            ScopedTraceLabel label(filenames->image);
+            try {
+                storeSample(pair, waitForStorage(*pending), slot);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            finishSlot(*pending, error);
+        }
+    }
+
+    DataProvider::~DataProvider() {
+        // Terminate the worker threads. They finish the sample they are 
+        // currently working on before they notice the flag.
+        {
+            std::lock_guard<std::mutex> lock(batchAccessMutex);
+            terminateThread = true;
+        }
+        slotAvailable.notify_all();
+
+        for (auto i = workers.begin(); i != workers.end(); i++) {
+            i->join();
+        }
     }
 
-} // namespace chianti
\ No newline at end of file
+} // namespace chianti
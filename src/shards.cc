@@ -0,0 +1,598 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+#include "chianti/shards.h"
+
+#include "index.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace chianti {
+
+    /**
+     * Identifies the index file and the version of the format.
+     */
+    static const char kMagic[8] = {'C', 'H', 'S', 'H', 'A', 'R', 'D', '3'};
+
+    /**
+     * The alignment of the pairs in the shards.
+     */
+    static const size_t kAlignment = 64;
+
+    /**
+     * Returns the number of bytes of pixel data of an image.
+     *
+     * @param shape The rows, columns and type of the image. Must be valid.
+     * @return The number of bytes.
+     */
+    static uint64_t imageBytes(const int32_t shape[3]) {
+        return static_cast<uint64_t>(shape[0]) * shape[1] *
+                CV_ELEM_SIZE(shape[2]);
+    }
+
+    /**
+     * Returns true if a shape read from an index describes an image with at
+     * most the given number of bytes.
+     *
+     * @param shape The rows, columns and type of the image.
+     * @param limit The maximum number of bytes.
+     * @return True if the shape is valid.
+     */
+    static bool isValidShape(const int32_t shape[3], uint64_t limit) {
+        if (shape[0] <= 0 || shape[1] <= 0 || shape[2] < 0 ||
+                shape[2] != (shape[2] & CV_MAT_TYPE_MASK)) {
+            return false;
+        }
+        const uint64_t elementSize = CV_ELEM_SIZE(shape[2]);
+        const uint64_t numElements = static_cast<uint64_t>(shape[0]) * 
+                static_cast<uint64_t>(shape[1]);
+        return elementSize > 0 && numElements <= limit / elementSize;
+    }
+
+    /**
+     * Returns the description of a preprocessor.
+     *
+     * @param preprocessor The preprocessor or null.
+     * @return The description or an empty string.
+     */
+    static std::string describe(
+            const std::shared_ptr<AugmentorInterface> & preprocessor) {
+        return preprocessor != nullptr ? 
+                preprocessor->getDescription() : std::string();
+    }
+
+    /**
+     * Hashes a list of pairs independently of their order.
+     *
+     * @param files The pairs.
+     * @return The hash.
+     */
+    static uint64_t hashFiles(const std::vector<FilenamePair> & files) {
+        uint64_t result = 0;
+        for (auto i = files.begin(); i != files.end(); i++) {
+            // FNV-1a of the filenames including their terminators
+            uint64_t hash = 14695981039346656037ull;
+            const std::string * names[2] = {&i->image, &i->target};
+            for (int k = 0; k < 2; k++) {
+                const char * name = names[k]->c_str();
+                for (size_t c = 0; c <= names[k]->size(); c++) {
+                    hash = (hash ^ static_cast<uchar>(name[c])) * 
+                            1099511628211ull;
+                }
+            }
+            result += hash;
+        }
+        return result;
+    }
+
+    /**
+     * Reads the header of an index up to and including the shard names.
+     *
+     * @param index The index.
+     * @param path The path of the index for error messages.
+     * @param loader The description of the loaders.
+     * @param preprocessor The description of the preprocessor.
+     * @param filesHash The hash of the pairs the cache was built from.
+     * @param shardNames The filenames of the shards.
+     */
+    static void readHeader(
+            std::istream & index,
+            const std::string & path,
+            std::string & loader,
+            std::string & preprocessor,
+            uint64_t & filesHash,
+            std::vector<std::string> & shardNames) {
+        char magic[sizeof(kMagic)];
+        index.read(magic, sizeof(magic));
+        if (!index || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+            throw std::runtime_error("'" + path + "' is not a shard "
+                    "cache index.");
+        }
+
+        loader = readIndexString(index);
+        preprocessor = readIndexString(index);
+        filesHash = readIndexValue<uint64_t>(index);
+        const uint32_t numShards = readIndexValue<uint32_t>(index);
+        for (uint32_t i = 0; i < numShards; i++) {
+            shardNames.push_back(readIndexString(index));
+        }
+    }
+
+    /**
+     * Deletes shards. Processes that have mapped them keep their mappings.
+     *
+     * @param directory The directory of the cache.
+     * @param shardNames The filenames of the shards. Empty names are 
+     *                   skipped.
+     */
+    static void removeShards(
+            const std::string & directory,
+            const std::vector<std::string> & shardNames) {
+        for (auto i = shardNames.begin(); i != shardNames.end(); i++) {
+            if (!i->empty()) {
+                std::remove((directory + "/" + *i).c_str());
+            }
+        }
+    }
+
+    /**
+     * Loads a pair and applies the preprocessor.
+     *
+     * @param loader The loader.
+     * @param preprocessor The deterministic augmentor or null.
+     * @param filenames The filenames of the pair.
+     * @return The preprocessed pair.
+     */
+    static ImageTargetPair loadPreprocessed(
+            const ImageTargetPairLoader & loader,
+            AugmentorInterface * preprocessor,
+            IteratorInterface::ElementIterator filenames) {
+        const int reduction = preprocessor != nullptr ?
+                preprocessor->getDecodeReduction() : 1;
+        ImageTargetPair pair = loader.load(filenames, reduction);
+        if (preprocessor != nullptr) {
+            preprocessor->augment(pair);
+        }
+        return pair;
+    }
+
+    /**
+     * Throws if the preprocessor of a cache draws random numbers.
+     *
+     * @param preprocessor The preprocessor or null.
+     */
+    static void assertDeterministic(
+            const std::shared_ptr<AugmentorInterface> & preprocessor) {
+        if (preprocessor != nullptr && !preprocessor->isDeterministic()) {
+            throw std::runtime_error("The preprocessor of a shard cache must "
+                    "be deterministic.");
+        }
+    }
+
+    /**
+     * Writes a block of bytes to a file.
+     *
+     * @param file The file.
+     * @param data The bytes.
+     * @param size The number of bytes.
+     * @param path The path of the file for error messages.
+     */
+    static void writeBytes(
+            std::FILE * file,
+            const void * data,
+            size_t size,
+            const std::string & path) {
+        if (size > 0 && std::fwrite(data, 1, size, file) != size) {
+            throw std::runtime_error("Could not write '" + path + "'.");
+        }
+    }
+
+    ShardCache::ShardCache(const std::string& directory) :
+    filesHash(0) {
+        const std::string path = directory + "/index";
+        std::ifstream index(path.c_str(), std::ios::binary);
+        if (!index) {
+            throw std::runtime_error("Could not open '" + path + "'.");
+        }
+
+        try {
+            std::vector<std::string> shardNames;
+            readHeader(index, path, loader, preprocessor, filesHash, 
+                    shardNames);
+
+            // Map the shards
+            for (auto i = shardNames.begin(); i != shardNames.end(); i++) {
+                const std::string shardPath = directory + "/" + *i;
+                const int fd = open(shardPath.c_str(), O_RDONLY);
+                if (fd < 0) {
+                    throw std::runtime_error(
+                            "Could not open '" + shardPath + "'.");
+                }
+
+                struct stat status;
+                Shard shard = {nullptr, 0};
+                void * data = MAP_FAILED;
+                if (fstat(fd, &status) == 0 && status.st_size > 0) {
+                    shard.size = static_cast<size_t>(status.st_size);
+                    data = mmap(nullptr, shard.size, PROT_READ, MAP_SHARED,
+                            fd, 0);
+                }
+                close(fd);
+                if (data == MAP_FAILED) {
+                    throw std::runtime_error(
+                            "Could not map '" + shardPath + "'.");
+                }
+                shard.data = static_cast<const uchar *>(data);
+                shards.push_back(shard);
+            }
+
+            // Read the entries and make sure they lie within their shards
+            const uint64_t numEntries = readIndexValue<uint64_t>(index);
+            for (uint64_t i = 0; i < numEntries; i++) {
+                std::pair<std::string, std::string> key;
+                key.first = readIndexString(index);
+                key.second = readIndexString(index);
+
+                Entry entry;
+                entry.shard = readIndexValue<uint32_t>(index);
+                entry.offset = readIndexValue<uint64_t>(index);
+                for (int k = 0; k < 3; k++) {
+                    entry.image[k] = readIndexValue<int32_t>(index);
+                }
+                for (int k = 0; k < 3; k++) {
+                    entry.target[k] = readIndexValue<int32_t>(index);
+                }
+
+                // Check each term, so corrupt values cannot overflow
+                const uint64_t size = entry.shard < shards.size() ? 
+                        shards[entry.shard].size : 0;
+                if (entry.offset > size || 
+                        !isValidShape(entry.image, size - entry.offset) ||
+                        !isValidShape(entry.target, size - entry.offset - 
+                                imageBytes(entry.image))) {
+                    throw std::runtime_error("The shard cache in '" +
+                            directory + "' is corrupt.");
+                }
+                entries[key] = entry;
+            }
+        } catch (...) {
+            // The destructor does not run if the constructor throws
+            for (auto i = shards.begin(); i != shards.end(); i++) {
+                munmap(const_cast<uchar *>(i->data), i->size);
+            }
+            throw;
+        }
+    }
+
+    ShardCache::~ShardCache() {
+        for (auto i = shards.begin(); i != shards.end(); i++) {
+            munmap(const_cast<uchar *>(i->data), i->size);
+        }
+    }
+
+    bool ShardCache::exists(const std::string& directory) {
+        struct stat status;
+        return stat((directory + "/index").c_str(), &status) == 0;
+    }
+
+    std::shared_ptr<ShardCache> ShardCache::build(
+            const std::string& directory,
+            const ImageTargetPairLoader& loader,
+            std::shared_ptr<AugmentorInterface> preprocessor,
+            std::vector<FilenamePair> files,
+            int numThreads,
+            size_t shardSize) {
+        assertDeterministic(preprocessor);
+        if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::runtime_error(
+                    "Could not create '" + directory + "'.");
+        }
+
+        // Shards of concurrent builds must not overwrite each other
+        std::stringstream prefix;
+        prefix << "shard_" << getpid() << "_"
+                << std::chrono::system_clock::now().time_since_epoch().count()
+                << "_";
+
+        std::atomic<size_t> nextFile(0);
+        std::atomic<uint32_t> nextShard(0);
+        std::vector<std::string> shardNames;
+        std::vector<std::pair<size_t, Entry>> stored;
+        std::exception_ptr error;
+        std::mutex accessMutex;
+
+        // Every thread appends the pairs it loads to a shard of its own
+        auto work = [&]() {
+            std::FILE * file = nullptr;
+            std::string path;
+            uint32_t shard = 0;
+            uint64_t offset = 0;
+
+            try {
+                while (true) {
+                    const size_t i = nextFile++;
+                    if (i >= files.size()) {
+                        break;
+                    }
+                    {
+                        std::lock_guard<std::mutex> lock(accessMutex);
+                        if (error) {
+                            break;
+                        }
+                    }
+
+                    ImageTargetPair pair = loadPreprocessed(
+                            loader, preprocessor.get(), files.begin() + i);
+                    const cv::Mat image = pair.image.isContinuous() ?
+                            pair.image : pair.image.clone();
+                    const cv::Mat target = pair.target.isContinuous() ?
+                            pair.target : pair.target.clone();
+
+                    Entry entry = {
+                        0, 0,
+                        {image.rows, image.cols, image.type()},
+                        {target.rows, target.cols, target.type()}
+                    };
+                    const uint64_t bytes =
+                            imageBytes(entry.image) + imageBytes(entry.target);
+
+                    // Start a new shard when the current one is full
+                    if (file == nullptr ||
+                            (offset > 0 && offset + bytes > shardSize)) {
+                        if (file != nullptr && std::fclose(file) != 0) {
+                            file = nullptr;
+                            throw std::runtime_error(
+                                    "Could not write '" + path + "'.");
+                        }
+                        shard = nextShard++;
+                        std::stringstream name;
+                        name << prefix.str() << shard << ".bin";
+                        path = directory + "/" + name.str();
+                        file = std::fopen(path.c_str(), "wb");
+                        if (file == nullptr) {
+                            throw std::runtime_error(
+                                    "Could not create '" + path + "'.");
+                        }
+                        offset = 0;
+
+                        std::lock_guard<std::mutex> lock(accessMutex);
+                        if (shardNames.size() <= shard) {
+                            shardNames.resize(shard + 1);
+                        }
+                        shardNames[shard] = name.str();
+                    }
+
+                    writeBytes(file, image.data, imageBytes(entry.image),
+                            path);
+                    writeBytes(file, target.data, imageBytes(entry.target),
+                            path);
+                    const size_t padding =
+                            (kAlignment - bytes % kAlignment) % kAlignment;
+                    const char zeros[kAlignment] = {0};
+                    writeBytes(file, zeros, padding, path);
+
+                    entry.shard = shard;
+                    entry.offset = offset;
+                    offset += bytes + padding;
+
+                    std::lock_guard<std::mutex> lock(accessMutex);
+                    stored.push_back(std::make_pair(i, entry));
+                }
+
+                if (file != nullptr) {
+                    std::FILE * closing = file;
+                    file = nullptr;
+                    if (std::fclose(closing) != 0) {
+                        throw std::runtime_error(
+                                "Could not write '" + path + "'.");
+                    }
+                }
+            } catch (...) {
+                if (file != nullptr) {
+                    std::fclose(file);
+                }
+                std::lock_guard<std::mutex> lock(accessMutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (int i = 1; i < numThreads; i++) {
+            threads.push_back(std::thread(work));
+        }
+        work();
+        for (auto i = threads.begin(); i != threads.end(); i++) {
+            i->join();
+        }
+
+        // Write the index and move it into place, so readers never see a
+        // partial cache
+        const std::string path = directory + "/index";
+        const std::string temporary = 
+                directory + "/" + prefix.str() + "index.tmp";
+        try {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+
+            std::ofstream index(temporary.c_str(), std::ios::binary);
+            index.write(kMagic, sizeof(kMagic));
+            writeIndexString(index, loader.getDescription());
+            writeIndexString(index, describe(preprocessor));
+            writeIndexValue(index, hashFiles(files));
+            writeIndexValue(index, static_cast<uint32_t>(shardNames.size()));
+            for (auto i = shardNames.begin(); i != shardNames.end(); i++) {
+                writeIndexString(index, *i);
+            }
+            writeIndexValue(index, static_cast<uint64_t>(stored.size()));
+            for (auto i = stored.begin(); i != stored.end(); i++) {
+                const Entry & entry = i->second;
+                writeIndexString(index, files[i->first].image);
+                writeIndexString(index, files[i->first].target);
+                writeIndexValue(index, entry.shard);
+                writeIndexValue(index, entry.offset);
+                for (int k = 0; k < 3; k++) {
+                    writeIndexValue(index, entry.image[k]);
+                }
+                for (int k = 0; k < 3; k++) {
+                    writeIndexValue(index, entry.target[k]);
+                }
+            }
+            index.close();
+            if (!index) {
+                throw std::runtime_error(
+                        "Could not write '" + temporary + "'.");
+            }
+        } catch (...) {
+            std::remove(temporary.c_str());
+            removeShards(directory, shardNames);
+            throw;
+        }
+
+        // The shards of the cache that is replaced
+        std::vector<std::string> previousShards;
+        try {
+            std::ifstream previous(path.c_str(), std::ios::binary);
+            if (previous) {
+                std::string loader;
+                std::string preprocessor;
+                uint64_t filesHash;
+                readHeader(previous, path, loader, preprocessor, filesHash, 
+                        previousShards);
+            }
+        } catch (const std::runtime_error &) {
+            // A corrupt index is replaced, but its shards are unknown
+            previousShards.clear();
+        }
+
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::remove(temporary.c_str());
+            removeShards(directory, shardNames);
+            throw std::runtime_error(
+                    "Could not write the index of '" + directory + "'.");
+        }
+        removeShards(directory, previousShards);
+
+        return std::make_shared<ShardCache>(directory);
+    }
+
+    std::shared_ptr<ShardCache> ShardCache::openOrBuild(
+            const std::string& directory,
+            const ImageTargetPairLoader& loader,
+            std::shared_ptr<AugmentorInterface> preprocessor,
+            std::vector<FilenamePair> files,
+            int numThreads,
+            size_t shardSize) {
+        // A cache of other pairs, loaders or preprocessor is rebuilt, and
+        // so is a cache that cannot be opened
+        if (exists(directory)) {
+            std::shared_ptr<ShardCache> cache;
+            try {
+                cache = std::make_shared<ShardCache>(directory);
+            } catch (const std::exception &) {
+                cache = nullptr;
+            }
+            if (cache != nullptr &&
+                    cache->loader == loader.getDescription() &&
+                    cache->preprocessor == describe(preprocessor) &&
+                    cache->filesHash == hashFiles(files)) {
+                return cache;
+            }
+        }
+        return build(directory, loader, preprocessor, std::move(files),
+                numThreads, shardSize);
+    }
+
+    bool ShardCache::find(
+            const FilenamePair& filenames,
+            ImageTargetPair& pair) const {
+        auto entry = entries.find(
+                std::make_pair(filenames.image, filenames.target));
+        if (entry == entries.end()) {
+            return false;
+        }
+
+        // Augmentors modify the pair in place, so it is copied out of the
+        // read-only mapping
+        const Entry & e = entry->second;
+        uchar * data = const_cast<uchar *>(shards[e.shard].data + e.offset);
+        const cv::Mat image(e.image[0], e.image[1], e.image[2], data);
+        const cv::Mat target(e.target[0], e.target[1], e.target[2],
+                data + imageBytes(e.image));
+        pair = ImageTargetPair(image.clone(), target.clone());
+        return true;
+    }
+
+    ShardCacheLoader::ShardCacheLoader(
+            std::shared_ptr<LoaderInterface> _imageLoader,
+            std::shared_ptr<LoaderInterface> _targetLoader,
+            std::shared_ptr<AugmentorInterface> _preprocessor,
+            std::shared_ptr<ShardCache> _cache) :
+    ImageTargetPairLoader(_imageLoader, _targetLoader),
+    preprocessor(_preprocessor),
+    cache(_cache),
+    shardStage(nullptr) {
+        assertDeterministic(preprocessor);
+        if (cache->getLoader() != getDescription()) {
+            throw std::runtime_error("The shard cache was built with the "
+                    "loaders '" + cache->getLoader() + "', not '" +
+                    getDescription() + "'.");
+        }
+        if (cache->getPreprocessor() != describe(preprocessor)) {
+            throw std::runtime_error("The shard cache was built with the "
+                    "preprocessor '" + cache->getPreprocessor() + "', not '" +
+                    describe(preprocessor) + "'.");
+        }
+    }
+
+    ImageTargetPair ShardCacheLoader::load(
+            IteratorInterface::ElementIterator filenames,
+            int imageReduction) const {
+        const auto start = std::chrono::steady_clock::now();
+        ImageTargetPair pair;
+        if (cache->find(*filenames, pair)) {
+            if (shardStage != nullptr) {
+                shardStage->record(start, std::chrono::steady_clock::now());
+            }
+            return pair;
+        }
+
+        // Pairs that were added after the cache was built
+        const int reduction = preprocessor != nullptr ?
+                preprocessor->getDecodeReduction() : 1;
+        pair = ImageTargetPairLoader::load(filenames, reduction);
+        if (preprocessor != nullptr) {
+            preprocessor->augment(pair);
+        }
+        return pair;
+    }
+
+    void ShardCacheLoader::instrument(std::shared_ptr<Stats> _stats) {
+        ImageTargetPairLoader::instrument(_stats);
+        shardStage = &_stats->getStage("load.shard");
+    }
+
+} // namespace chianti
@@ -0,0 +1,44 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+#include "chianti/sources.h"
+
+#include <fstream>
+#include <stdexcept>
+
+namespace chianti {
+
+    void FileByteSource::read(
+            const FilenamePair& filenames,
+            std::vector<uchar>& image,
+            std::vector<uchar>& target) const {
+        readFile(filenames.image, image);
+        readFile(filenames.target, target);
+    }
+
+    void FileByteSource::readFile(
+            const std::string& filename, 
+            std::vector<uchar>& buffer) {
+        std::ifstream file(filename.c_str(), std::ios::binary | std::ios::ate);
+        if (!file) {
+            throw std::runtime_error("Could not open '" + filename + "'.");
+        }
+
+        // Read the file in one piece instead of byte by byte
+        const std::streamoff size = file.tellg();
+        buffer.resize(size > 0 ? static_cast<size_t>(size) : 0);
+        file.seekg(0);
+        if (!buffer.empty()) {
+            file.read(reinterpret_cast<char *>(buffer.data()), buffer.size());
+        }
+        if (!file) {
+            throw std::runtime_error("Could not read '" + filename + "'.");
+        }
+    }
+
+} // namespace chianti
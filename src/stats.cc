@@ -0,0 +1,100 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+#include "chianti/stats.h"
+
+#include <algorithm>
+
+namespace chianti {
+
+    const int StageStats::kNumBins;
+
+    StageStats::StageStats(const std::string & _name, Tracer * _tracer) :
+    name(_name),
+    tracer(_tracer) {
+        clear();
+    }
+
+    void StageStats::record(std::chrono::steady_clock::duration duration) {
+        const auto nanoseconds = static_cast<uint64_t>(std::max<int64_t>(0, 
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                duration).count()));
+
+        // Find the power of two bin of the latency in microseconds
+        uint64_t microseconds = nanoseconds / 1000;
+        int bin = 0;
+        while (microseconds > 0 && bin < kNumBins - 1) {
+            microseconds >>= 1;
+            bin++;
+        }
+
+        count.fetch_add(1, std::memory_order_relaxed);
+        totalNanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+        histogram[bin].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void StageStats::record(
+            std::chrono::steady_clock::time_point start,
+            std::chrono::steady_clock::time_point end) {
+        record(end - start);
+        if (tracer != nullptr && tracer->isEnabled()) {
+            tracer->record(name, start, end);
+        }
+    }
+
+    StageSummary StageStats::summarize() const {
+        StageSummary summary;
+        summary.name = name;
+        summary.count = count.load(std::memory_order_relaxed);
+        summary.totalSeconds = 1e-9 * static_cast<double>(
+                totalNanoseconds.load(std::memory_order_relaxed));
+        for (int i = 0; i < kNumBins; i++) {
+            summary.histogram.push_back(
+                    histogram[i].load(std::memory_order_relaxed));
+        }
+        return summary;
+    }
+
+    void StageStats::clear() {
+        count.store(0, std::memory_order_relaxed);
+        totalNanoseconds.store(0, std::memory_order_relaxed);
+        for (int i = 0; i < kNumBins; i++) {
+            histogram[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    StageStats & Stats::getStage(const std::string & name) {
+        std::lock_guard<std::mutex> lock(accessMutex);
+        for (auto i = stages.begin(); i != stages.end(); i++) {
+            if (i->first == name) {
+                return *i->second;
+            }
+        }
+        stages.push_back(std::make_pair(
+                name, std::unique_ptr<StageStats>(
+                new StageStats(name, &tracer))));
+        return *stages.back().second;
+    }
+
+    std::vector<StageSummary> Stats::summarize() const {
+        std::lock_guard<std::mutex> lock(accessMutex);
+        std::vector<StageSummary> result;
+        for (auto i = stages.begin(); i != stages.end(); i++) {
+            result.push_back(i->second->summarize());
+        }
+        return result;
+    }
+
+    void Stats::clear() {
+        std::lock_guard<std::mutex> lock(accessMutex);
+        for (auto i = stages.begin(); i != stages.end(); i++) {
+            i->second->clear();
+        }
+    }
+
+} // namespace chianti
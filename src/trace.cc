@@ -0,0 +1,151 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+#include "chianti/trace.h"
+
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+
+namespace chianti {
+
+    /**
+     * The label of the sample the calling thread is working on.
+     */
+    static thread_local const std::string * currentLabel = nullptr;
+
+    /**
+     * Writes a string as a JSON string literal.
+     *
+     * @param stream The stream to write to.
+     * @param value The string to write.
+     */
+    static void writeJsonString(std::ostream & stream,
+            const std::string & value) {
+        stream << '"';
+        for (auto i = value.begin(); i != value.end(); i++) {
+            switch (*i) {
+                case '"':
+                    stream << "\\\"";
+                    break;
+                case '\\':
+                    stream << "\\\\";
+                    break;
+                case '\n':
+                    stream << "\\n";
+                    break;
+                case '\t':
+                    stream << "\\t";
+                    break;
+                default:
+                    if (static_cast<unsigned char>(*i) < 0x20) {
+                        char escaped[7];
+                        std::snprintf(escaped, sizeof(escaped), "\\u%04x",
+                                static_cast<unsigned char>(*i));
+                        stream << escaped;
+                    } else {
+                        stream << *i;
+                    }
+            }
+        }
+        stream << '"';
+    }
+
+    Tracer::Tracer() :
+    enabled(false),
+    origin(std::chrono::steady_clock::now()) {
+    }
+
+    void Tracer::start() {
+        std::lock_guard<std::mutex> lock(accessMutex);
+        spans.clear();
+        threads.clear();
+        origin = std::chrono::steady_clock::now();
+        enabled.store(true);
+    }
+
+    void Tracer::stop() {
+        enabled.store(false);
+    }
+
+    void Tracer::record(
+            const std::string& name,
+            std::chrono::steady_clock::time_point start,
+            std::chrono::steady_clock::time_point end) {
+        if (!isEnabled()) {
+            return;
+        }
+
+        const std::string * label = ScopedTraceLabel::current();
+        std::lock_guard<std::mutex> lock(accessMutex);
+        auto thread = threads.insert(std::make_pair(
+                std::this_thread::get_id(),
+                static_cast<int>(threads.size()))).first;
+        Span span = {
+            name,
+            label != nullptr ? *label : std::string(),
+            thread->second,
+            start,
+            end
+        };
+        spans.push_back(span);
+    }
+
+    void Tracer::write(std::ostream& stream) const {
+        std::lock_guard<std::mutex> lock(accessMutex);
+        const auto precision = stream.precision(15);
+        stream << "{\"traceEvents\":[";
+        for (size_t i = 0; i < spans.size(); i++) {
+            const Span & span = spans[i];
+            const double start = std::chrono::duration<double, std::micro>(
+                    span.start - origin).count();
+            const double duration = std::chrono::duration<double, std::micro>(
+                    span.end - span.start).count();
+
+            stream << (i > 0 ? ",\n" : "\n") << "{\"name\":";
+            writeJsonString(stream, span.name);
+            stream << ",\"cat\":\"chianti\",\"ph\":\"X\",\"pid\":0"
+                    << ",\"tid\":" << span.thread
+                    << ",\"ts\":" << start
+                    << ",\"dur\":" << duration;
+            if (!span.label.empty()) {
+                stream << ",\"args\":{\"sample\":";
+                writeJsonString(stream, span.label);
+                stream << "}";
+            }
+            stream << "}";
+        }
+        stream << "\n],\"displayTimeUnit\":\"ms\"}\n";
+        stream.precision(precision);
+    }
+
+    void Tracer::save(const std::string& filename) const {
+        std::ofstream file(filename.c_str());
+        if (!file) {
+            throw std::runtime_error("Could not open " + filename);
+        }
+        write(file);
+        if (!file) {
+            throw std::runtime_error("Could not write " + filename);
+        }
+    }
+
+    ScopedTraceLabel::ScopedTraceLabel(const std::string& label) :
+    previous(currentLabel) {
+        currentLabel = &label;
+    }
+
+    ScopedTraceLabel::~ScopedTraceLabel() {
+        currentLabel = previous;
+    }
+
+    const std::string * ScopedTraceLabel::current() {
+        return currentLabel;
+    }
+
+} // namespace chianti
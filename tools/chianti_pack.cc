@@ -0,0 +1,77 @@
+/* Copyright (C) 2017 Google Inc.
+ * 
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms of the MIT 
+ * license.  See the LICENSE file for details.
+ */
+
+/**
+ * Packs image/target pairs into a single data file with an offset index, 
+ * which can be read with the PackImageTargetPairLoader. The list holds one 
+ * pair per line: the image filename and the target filename separated by a 
+ * tab. The filenames are stored as they appear in the list.
+ *
+ * Usage: chianti-pack LIST PACK
+ */
+
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "chianti/packs.h"
+
+int main(int argc, char ** argv) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " LIST PACK" << std::endl;
+        return 1;
+    }
+
+    try {
+        const std::string listPath = argv[1];
+        std::ifstream list(listPath.c_str());
+        if (!list) {
+            throw std::runtime_error("Could not open '" + listPath + "'.");
+        }
+
+        chianti::PackWriter writer(argv[2]);
+        std::string line;
+        for (size_t number = 1; std::getline(list, line); number++) {
+            if (!line.empty() && line[line.size() - 1] == '\r') {
+                line.erase(line.size() - 1);
+            }
+            if (line.empty()) {
+                continue;
+            }
+
+            const size_t tab = line.find('\t');
+            if (tab == std::string::npos) {
+                std::stringstream error;
+                error << "Line " << number << " of '" << listPath 
+                        << "' is not a tab separated pair of filenames.";
+                throw std::runtime_error(error.str());
+            }
+            chianti::FilenamePair pair;
+            pair.image = line.substr(0, tab);
+            pair.target = line.substr(tab + 1);
+            writer.add(pair);
+
+            if (writer.getNumPairs() % 10000 == 0) {
+                std::cerr << "Packed " << writer.getNumPairs() << " pairs" 
+                        << std::endl;
+            }
+        }
+        writer.close();
+
+        std::cerr << "Packed " << writer.getNumPairs() << " pairs (" 
+                << writer.getSize() << " bytes) into '" << argv[2] << "'" 
+                << std::endl;
+    } catch (const std::exception & e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}